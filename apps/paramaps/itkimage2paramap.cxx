@@ -21,10 +21,42 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
-  FloatReaderType::Pointer reader = FloatReaderType::New();
-  reader->SetFileName(inputFileName.c_str());
-  reader->Update();
-  FloatImageType::Pointer parametricMapImage = reader->GetOutput();
+  // 4D images are stored as a single parametric map with one volume per temporal position
+  itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(inputFileName.c_str(), itk::ImageIOFactory::ReadMode);
+  if(imageIO.IsNull()){
+    cerr << "Error: cannot read " << inputFileName << endl;
+    return EXIT_FAILURE;
+  }
+  imageIO->SetFileName(inputFileName);
+  imageIO->ReadImageInformation();
+  const bool is4D = imageIO->GetNumberOfDimensions() == 4;
+  if(is4D && pixelType == "double"){
+    cerr << "Error: double precision is not supported for 4D parametric maps" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // double precision maps are read without converting the input to float
+  FloatImageType::Pointer parametricMapImage;
+  DoubleImageType::Pointer doubleParametricMapImage;
+  Float4DImageType::Pointer parametricMapImage4D;
+  if(is4D){
+    Float4DReaderType::Pointer reader = Float4DReaderType::New();
+    reader->SetFileName(inputFileName.c_str());
+    reader->Update();
+    parametricMapImage4D = reader->GetOutput();
+    // the geometry of the first volume is used to select the source series
+    parametricMapImage = dcmqi::ParaMapConverter::getFirstVolume(parametricMapImage4D);
+  } else if(pixelType == "double"){
+    DoubleReaderType::Pointer reader = DoubleReaderType::New();
+    reader->SetFileName(inputFileName.c_str());
+    reader->Update();
+    doubleParametricMapImage = reader->GetOutput();
+  } else {
+    FloatReaderType::Pointer reader = FloatReaderType::New();
+    reader->SetFileName(inputFileName.c_str());
+    reader->Update();
+    parametricMapImage = reader->GetOutput();
+  }
 
   if(dicomDirectory.size()){
     if (!helper::pathExists(dicomDirectory))
@@ -33,7 +65,27 @@ int main(int argc, char *argv[])
     dicomImageFileList.insert(dicomImageFileList.end(), dicomFileList.begin(), dicomFileList.end());
   }
 
-  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFileList);
+  dcmqi::DICOMFileIndex dicomIndex(dicomIndexFileName);
+  // the index is only used to select the source series
+  if(filterSeries && dicomIndexFileName.size()){
+    // the entries of files removed from the DICOM directory are dropped
+    vector<string> dicomRootDirectories;
+    if(dicomDirectory.size())
+      dicomRootDirectories.push_back(dicomDirectory);
+    dicomIndex.read();
+    dicomIndex.update(dicomImageFileList, dicomRootDirectories, threads);
+    if(!dicomIndex.write())
+      return EXIT_FAILURE;
+  }
+
+  if(filterSeries && doubleParametricMapImage)
+    dicomImageFileList = dcmqi::ParaMapConverter::selectSourceSeriesFiles<DoubleImageType>(dicomImageFileList, doubleParametricMapImage, threads,
+        dicomIndexFileName.size() ? &dicomIndex : NULL);
+  else if(filterSeries)
+    dicomImageFileList = dcmqi::ParaMapConverter::selectSourceSeriesFiles<FloatImageType>(dicomImageFileList, parametricMapImage, threads,
+        dicomIndexFileName.size() ? &dicomIndex : NULL);
+
+  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFileList, true, threads);
 
   if(dcmDatasets.empty()){
     cerr << "Error: no DICOM could be loaded from the specified list/directory" << endl;
@@ -44,7 +96,13 @@ int main(int argc, char *argv[])
   std::string metadata( (std::istreambuf_iterator<char>(metainfoStream) ),
                         (std::istreambuf_iterator<char>()));
 
-  DcmDataset* result = dcmqi::ParaMapConverter::itkimage2paramap(parametricMapImage, dcmDatasets, metadata);
+  DcmDataset* result;
+  if(parametricMapImage4D)
+    result = dcmqi::ParaMapConverter::itkimage2paramap(parametricMapImage4D, dcmDatasets, metadata, pixelType);
+  else if(doubleParametricMapImage)
+    result = dcmqi::ParaMapConverter::itkimage2paramap(doubleParametricMapImage, dcmDatasets, metadata);
+  else
+    result = dcmqi::ParaMapConverter::itkimage2paramap(parametricMapImage, dcmDatasets, metadata, pixelType);
 
   if (result == NULL) {
     return EXIT_FAILURE;
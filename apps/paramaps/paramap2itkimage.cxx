@@ -25,19 +25,30 @@ int main(int argc, char *argv[])
   CHECK_COND(sliceFF.loadFile(inputFileName.c_str()));
   DcmDataset* dataset = sliceFF.getDataset();
 
-  pair <FloatImageType::Pointer, string> result =  dcmqi::ParaMapConverter::paramap2itkimage(dataset);
+  pair <Float4DImageType::Pointer, string> result =  dcmqi::ParaMapConverter::paramap2itkimage4D(dataset, threads);
 
   string fileExtension = helper::getFileExtensionFromType(outputType);
 
-  typedef itk::ImageFileWriter<FloatImageType> WriterType;
   string outputPrefix = prefix.empty() ? "" : prefix + "-";
-  WriterType::Pointer writer = WriterType::New();
   stringstream imageFileNameSStream;
   imageFileNameSStream << outputDirName << "/" << outputPrefix << "pmap" << fileExtension;
-  writer->SetFileName(imageFileNameSStream.str().c_str());
-  writer->SetInput(result.first);
-  writer->SetUseCompression(1);
-  writer->Update();
+
+  // parametric maps with a single volume are saved as 3D images
+  if(result.first->GetLargestPossibleRegion().GetSize()[3] > 1){
+    typedef itk::ImageFileWriter<Float4DImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(imageFileNameSStream.str().c_str());
+    writer->SetInput(result.first);
+    writer->SetUseCompression(1);
+    writer->Update();
+  } else {
+    typedef itk::ImageFileWriter<FloatImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(imageFileNameSStream.str().c_str());
+    writer->SetInput(dcmqi::ParaMapConverter::getFirstVolume(result.first));
+    writer->SetUseCompression(1);
+    writer->Update();
+  }
 
   stringstream jsonOutput;
   jsonOutput << outputDirName << "/" << outputPrefix << "meta.json";
@@ -20,6 +20,17 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  if(transferSyntax == "Deflate"){
+#ifndef WITH_ZLIB
+    cerr << "Error: Deflate transfer syntax is not available, DCMTK was built without zlib!" << endl;
+    return EXIT_FAILURE;
+#endif
+  }
+  if(streamFrames && transferSyntax != "ExplicitLittleEndian"){
+    cerr << "Error: Streamed output can only be written in Explicit VR Little Endian!" << endl;
+    return EXIT_FAILURE;
+  }
+
   if(dicomImageFiles.empty() && dicomDirectory.empty()){
     cerr << "Error: No input DICOM files specified!" << endl;
     return EXIT_FAILURE;
@@ -45,7 +56,24 @@ int main(int argc, char *argv[])
   if(!helper::pathsExist(dicomImageFiles))
     return EXIT_FAILURE;
 
-  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFiles);
+  dcmqi::DICOMFileIndex dicomIndex(dicomIndexFileName);
+  // the index is only used to select the source series
+  if(filterSeries && dicomIndexFileName.size()){
+    // the entries of files removed from the DICOM directory are dropped
+    vector<string> dicomRootDirectories;
+    if(dicomDirectory.size())
+      dicomRootDirectories.push_back(dicomDirectory);
+    dicomIndex.read();
+    dicomIndex.update(dicomImageFiles, dicomRootDirectories, threads);
+    if(!dicomIndex.write())
+      return EXIT_FAILURE;
+  }
+
+  if(filterSeries)
+    dicomImageFiles = dcmqi::ImageSEGConverter::selectSourceSeriesFiles<ShortImageType>(dicomImageFiles, segmentations[0], threads,
+        dicomIndexFileName.size() ? &dicomIndex : NULL);
+
+  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFiles, true, threads);
 
   if(dcmDatasets.empty()){
     cerr << "Error: no DICOM could be loaded from the specified list/directory" << endl;
@@ -91,26 +119,37 @@ int main(int argc, char *argv[])
     segmentations = segmentationsReordered;
   }
 
-  DcmDataset* result = dcmqi::ImageSEGConverter::itkimage2dcmSegmentation(dcmDatasets, segmentations, metadata, skipEmptySlices);
+  DcmFileFormat segdocFF;
+  bool success;
+  if(streamFrames){
+    success = dcmqi::ImageSEGConverter::itkimage2dcmSegmentationFile(dcmDatasets, segmentations, metadata,
+                                                                     outputSEGFileName, skipEmptySlices, threads);
+  } else {
+    success = dcmqi::ImageSEGConverter::itkimage2dcmSegmentation(dcmDatasets, segmentations, metadata,
+                                                                 *segdocFF.getDataset(), skipEmptySlices, threads);
+  }
+
+  for(size_t i=0;i<dcmDatasets.size();i++) {
+    delete dcmDatasets[i];
+  }
 
-  if (result == NULL){
+  if (!success){
     return EXIT_FAILURE;
+  } else if(streamFrames){
+    COUT << "Saved segmentation as " << outputSEGFileName << endl;
   } else {
-    DcmFileFormat segdocFF(result);
-    bool compress = false;
-    if(compress){
-      CHECK_COND(segdocFF.saveFile(outputSEGFileName.c_str(), EXS_DeflatedLittleEndianExplicit));
-    } else {
-      CHECK_COND(segdocFF.saveFile(outputSEGFileName.c_str(), EXS_LittleEndianExplicit));
+    E_TransferSyntax outputXfer = EXS_LittleEndianExplicit;
+    if(transferSyntax == "RLE"){
+      if(!dcmqi::ImageSEGConverter::encodeRLE(*segdocFF.getDataset(), threads))
+        return EXIT_FAILURE;
+      outputXfer = EXS_RLELossless;
+    } else if(transferSyntax == "Deflate"){
+      outputXfer = EXS_DeflatedLittleEndianExplicit;
     }
+    CHECK_COND(segdocFF.saveFile(outputSEGFileName.c_str(), outputXfer));
 
     COUT << "Saved segmentation as " << outputSEGFileName << endl;
   }
 
-  for(size_t i=0;i<dcmDatasets.size();i++) {
-    delete dcmDatasets[i];
-  }
-  if (result != NULL)
-    delete result;
   return EXIT_SUCCESS;
 }
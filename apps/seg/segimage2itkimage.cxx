@@ -6,8 +6,13 @@
 #include "dcmqi/ImageSEGConverter.h"
 #include "dcmqi/internal/VersionConfigure.h"
 
+// ITK includes
+#include <itkCastImageFilter.h>
+#include <itkMinimumMaximumImageCalculator.h>
+
 
 typedef dcmqi::Helper helper;
+typedef itk::Image<unsigned char, 3> UCharImageType;
 
 
 int main(int argc, char *argv[])
@@ -24,23 +29,46 @@ int main(int argc, char *argv[])
   CHECK_COND(sliceFF.loadFile(inputSEGFileName.c_str()));
   DcmDataset* dataset = sliceFF.getDataset();
 
-  pair <map<unsigned,ShortImageType::Pointer>, string> result =  dcmqi::ImageSEGConverter::dcmSegmentation2itkimage(dataset);
+  pair <map<unsigned,ShortImageType::Pointer>, string> result =  dcmqi::ImageSEGConverter::dcmSegmentation2itkimage(dataset, mergeSegments, cropSegments, segments, threads);
 
   string outputPrefix = prefix.empty() ? "" : prefix + "-";
 
   string fileExtension = dcmqi::Helper::getFileExtensionFromType(outputType);
 
   for(map<unsigned,ShortImageType::Pointer>::const_iterator sI=result.first.begin();sI!=result.first.end();++sI){
-    typedef itk::ImageFileWriter<ShortImageType> WriterType;
     stringstream imageFileNameSStream;
 
-    imageFileNameSStream << outputDirName << "/" << outputPrefix << sI->first << fileExtension;
-
-    WriterType::Pointer writer = WriterType::New();
-    writer->SetFileName(imageFileNameSStream.str().c_str());
-    writer->SetInput(sI->second);
-    writer->SetUseCompression(1);
-    writer->Update();
+    // merged label images are numbered by layer rather than by segment
+    imageFileNameSStream << outputDirName << "/" << outputPrefix << (mergeSegments ? "layer-" : "") << sI->first << fileExtension;
+
+    if(outputPixelType == "uchar"){
+      typedef itk::MinimumMaximumImageCalculator<ShortImageType> MinMaxCalculatorType;
+      MinMaxCalculatorType::Pointer calculator = MinMaxCalculatorType::New();
+      calculator->SetImage(sI->second);
+      calculator->ComputeMaximum();
+      if(calculator->GetMaximum() > 255){
+        cerr << "ERROR: segment number " << calculator->GetMaximum() << " cannot be saved with unsigned char pixel type" << endl;
+        return EXIT_FAILURE;
+      }
+
+      typedef itk::CastImageFilter<ShortImageType,UCharImageType> CastFilterType;
+      CastFilterType::Pointer cast = CastFilterType::New();
+      cast->SetInput(sI->second);
+
+      typedef itk::ImageFileWriter<UCharImageType> WriterType;
+      WriterType::Pointer writer = WriterType::New();
+      writer->SetFileName(imageFileNameSStream.str().c_str());
+      writer->SetInput(cast->GetOutput());
+      writer->SetUseCompression(1);
+      writer->Update();
+    } else {
+      typedef itk::ImageFileWriter<ShortImageType> WriterType;
+      WriterType::Pointer writer = WriterType::New();
+      writer->SetFileName(imageFileNameSStream.str().c_str());
+      writer->SetInput(sI->second);
+      writer->SetUseCompression(1);
+      writer->Update();
+    }
   }
 
   stringstream jsonOutput;
@@ -3,6 +3,8 @@
 
 // STD includes
 #include <iostream>
+#include <map>
+#include <set>
 #include <vector>
 
 // VNL includes
@@ -29,6 +31,8 @@
 
 // DCMQI includes
 #include "dcmqi/Exceptions.h"
+#include "dcmqi/DICOMFileIndex.h"
+#include "dcmqi/FrameGeometryIndex.h"
 #include "dcmqi/JSONMetaInformationHandlerBase.h"
 #include "dcmqi/QIICRUIDs.h"
 #include "dcmqi/QIICRConstants.h"
@@ -94,112 +98,39 @@ namespace dcmqi {
       return 0;
     }
 
+    // positions of the frames along the slice direction (the third column of direction), shared by the volume
+    //  extent and the frame placement
     template <class T>
-    static int computeVolumeExtent(FGInterface &fgInterface, vnl_vector<double> &sliceDirection, T &imageOrigin,
-                                   double &sliceSpacing, double &sliceExtent) {
-      // Size
-      // Rows/Columns can be read directly from the respective attributes
-      // For number of slices, consider that all segments must have the same number of frames.
-      //   If we have FoR UID initialized, this means every segment should also have Plane
-      //   Position (Patient) initialized. So we can get the number of slices by looking
-      //   how many per-frame functional groups a segment has.
-
-      vector<double> originDistances;
-      map<OFString, double> originStr2distance;
-      map<OFString, unsigned> frame2overlap;
-      double minDistance = 0.0;
+    static int buildGeometryIndex(FGInterface &fgInterface, const T &direction, FrameGeometryIndex &geometryIndex) {
+      vnl_vector<double> sliceDirection(3);
+      sliceDirection[0] = direction[0][2];
+      sliceDirection[1] = direction[1][2];
+      sliceDirection[2] = direction[2][2];
+
+      if(!geometryIndex.build(fgInterface, sliceDirection)){
+        cerr << "Failed to index the frame positions!" << endl;
+        return EXIT_FAILURE;
+      }
+      return 0;
+    }
 
+    // origin, slice spacing and extent of the volume covered by the frames of the geometry index
+    template <class T>
+    static int computeVolumeExtent(const FrameGeometryIndex &geometryIndex, T &imageOrigin,
+                                   double &sliceSpacing, double &sliceExtent) {
       sliceSpacing = 0;
+      sliceExtent = 0;
 
-      unsigned numFrames = fgInterface.getNumberOfFrames();
-
-      /* Framesorter is to be moved to DCMTK at some point
-       * in the future. For now it is causing build issues on windows
-
-      FrameSorterIPP fsIPP;
-      FrameSorterIPP::Results sortResults;
-      fsIPP.setSorterInput(&fgInterface);
-      fsIPP.sort(sortResults);
-
-      */
-
-      // Determine ordering of the frames, keep mapping from ImagePositionPatient string
-      //   to the distance, and keep track (just out of curiousity) how many frames overlap
-      vnl_vector<double> refOrigin(3);
-      {
-        OFBool isPerFrame;
-        FGPlanePosPatient *planposfg = OFstatic_cast(FGPlanePosPatient*,
-                                                     fgInterface.get(0, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-        for(int j=0;j<3;j++){
-          OFString planposStr;
-          if(planposfg->getImagePositionPatient(planposStr, j).good()){
-            refOrigin[j] = atof(planposStr.c_str());
-          } else {
-            cerr << "Failed to read patient position" << endl;
-          }
-        }
+      const size_t numFrames = geometryIndex.getNumberOfFrames();
+      if(!numFrames){
+        cerr << "No frames to compute the volume extent from" << endl;
+        return EXIT_FAILURE;
       }
 
-      for(size_t frameId=0;frameId<numFrames;frameId++){
-        OFBool isPerFrame;
-        FGPlanePosPatient *planposfg = OFstatic_cast(FGPlanePosPatient*,
-                                                     fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-
-        if(!planposfg){
-          cerr << "PlanePositionPatient is missing" << endl;
-          return EXIT_FAILURE;
-        }
-
-        if(!isPerFrame){
-          cerr << "PlanePositionPatient is required for each frame!" << endl;
-          return EXIT_FAILURE;
-        }
-
-        vnl_vector<double> sOrigin;
-        OFString sOriginStr = "";
-        sOrigin.set_size(3);
-        for(int j=0;j<3;j++){
-          OFString planposStr;
-          if(planposfg->getImagePositionPatient(planposStr, j).good()){
-            sOrigin[j] = atof(planposStr.c_str());
-            sOriginStr += planposStr;
-            if(j<2)
-              sOriginStr+='/';
-          } else {
-            cerr << "Failed to read patient position" << endl;
-            return EXIT_FAILURE;
-          }
-        }
-
-        // check if this frame has already been encountered
-        if(originStr2distance.find(sOriginStr) == originStr2distance.end()){
-          vnl_vector<double> difference;
-          difference.set_size(3);
-          difference[0] = sOrigin[0]-refOrigin[0];
-          difference[1] = sOrigin[1]-refOrigin[1];
-          difference[2] = sOrigin[2]-refOrigin[2];
-          double dist = dot_product(difference,sliceDirection);
-          frame2overlap[sOriginStr] = 1;
-          originStr2distance[sOriginStr] = dist;
-          assert(originStr2distance.find(sOriginStr) != originStr2distance.end());
-          originDistances.push_back(dist);
-
-          if(frameId==0){
-            minDistance = dist;
-            imageOrigin[0] = sOrigin[0];
-            imageOrigin[1] = sOrigin[1];
-            imageOrigin[2] = sOrigin[2];
-          }
-          else if(dist<minDistance){
-            imageOrigin[0] = sOrigin[0];
-            imageOrigin[1] = sOrigin[1];
-            imageOrigin[2] = sOrigin[2];
-            minDistance = dist;
-          }
-        } else {
-          frame2overlap[sOriginStr]++;
-        }
-      }
+      const double *originPosition = geometryIndex.getImagePosition(geometryIndex.getOriginFrame());
+      imageOrigin[0] = originPosition[0];
+      imageOrigin[1] = originPosition[1];
+      imageOrigin[2] = originPosition[2];
 
       // it IS possible to have a segmentation object containing just one frame!
       if(numFrames>1){
@@ -209,30 +140,12 @@ namespace dcmqi {
         //  not have any information about whether the 2 frames are adjacent or not, so perhaps we should
         //  always rely on the declared spacing, and not even try to compute it?
         // TODO: discuss this with the QIICR team!
-
-        // sort all unique distances, this will be used to check consistency of
-        //  slice spacing, and also to locate the slice position from ImagePositionPatient
-        //  later when we read the segments
-        sort(originDistances.begin(), originDistances.end());
-
-        sliceSpacing = fabs(originDistances[0]-originDistances[1]);
-
-        for(size_t i=1;i<originDistances.size(); i++){
-          float dist1 = fabs(originDistances[i-1]-originDistances[i]);
-          float delta = sliceSpacing-dist1;
-        }
-
-        sliceExtent = fabs(originDistances[0]-originDistances[originDistances.size()-1]);
-        unsigned overlappingFramesCnt = 0;
-        for(map<OFString, unsigned>::const_iterator it=frame2overlap.begin();
-            it!=frame2overlap.end();++it){
-            if(it->second>1)
-              overlappingFramesCnt++;
-        }
+        sliceSpacing = geometryIndex.getSliceSpacing();
+        sliceExtent = geometryIndex.getExtent();
 
         cout << "Total frames: " << numFrames << endl;
-        cout << "Total frames with unique IPP: " << originDistances.size() << endl;
-        cout << "Total overlapping frames: " << overlappingFramesCnt << endl;
+        cout << "Total frames with unique IPP: " << geometryIndex.getNumberOfPositions() << endl;
+        cout << "Total overlapping frames: " << geometryIndex.getNumberOfOverlappingPositions() << endl;
         cout << "Origin: " << imageOrigin << endl;
       }
 
@@ -264,17 +177,18 @@ namespace dcmqi {
       return 0;
     }
 
-    // AF: I could not quickly figure out how to template this function over image type - suggestions are welcomed!
+    // only the geometry of the image is used, so that any image type can be passed without converting it
+    template <class ImageType>
     static vector<vector<int> > getSliceMapForSegmentation2DerivationImage(const vector<DcmDataset*> dcmDatasets,
-                                                                                       const ShortImageType::Pointer &labelImage) {
+                                                                           const typename ImageType::Pointer &labelImage) {
       // Find mapping from the segmentation slice number to the derivation image
       // Assume that orientation of the segmentation is the same as the source series
       unsigned numLabelSlices = labelImage->GetLargestPossibleRegion().GetSize()[2];
       vector<vector<int> > slice2derimg(numLabelSlices);
       for(size_t i=0;i<dcmDatasets.size();i++){
         OFString ippStr;
-        ShortImageType::PointType ippPoint;
-        ShortImageType::IndexType ippIndex;
+        typename ImageType::PointType ippPoint;
+        typename ImageType::IndexType ippIndex;
         for(int j=0;j<3;j++){
           CHECK_COND(dcmDatasets[i]->findAndGetOFString(DCM_ImagePositionPatient, ippStr, j));
           ippPoint[j] = atof(ippStr.c_str());
@@ -290,6 +204,74 @@ namespace dcmqi {
       return slice2derimg;
     }
 
+  public:
+    // Select the files of the series that the image was derived from: the files are grouped by
+    //  SeriesInstanceUID and FrameOfReferenceUID, and the group whose image positions cover the most slices of
+    //  the image is kept. The attributes of the files are taken from the index, if given, otherwise the files
+    //  are scanned up to the image plane module. Such a partial scan does not hold the attributes the
+    //  converters need, so the selected files are read again by Helper::loadDatasets. All files are returned
+    //  if none of the groups matches the image geometry.
+    template <class ImageType>
+    static vector<string> selectSourceSeriesFiles(const vector<string>& dicomImageFiles,
+                                                  const typename ImageType::Pointer &image,
+                                                  unsigned numberOfThreads=1,
+                                                  const DICOMFileIndex *dicomIndex=NULL){
+      DICOMFileIndex scannedFiles;
+      if(!dicomIndex){
+        scannedFiles.update(dicomImageFiles, vector<string>(), numberOfThreads);
+        dicomIndex = &scannedFiles;
+      }
+
+      // series that share a SeriesInstanceUID but not the frame of reference are kept apart
+      typedef pair<string, string> SeriesKeyType;
+      // (SeriesInstanceUID, FrameOfReferenceUID) -> file numbers
+      map<SeriesKeyType, vector<size_t> > series2files;
+      // (SeriesInstanceUID, FrameOfReferenceUID) -> slice numbers of the image covered by the series
+      map<SeriesKeyType, set<long> > series2slices;
+
+      for(size_t fileNumber=0;fileNumber<dicomImageFiles.size();fileNumber++){
+        const DICOMFileIndex::Entry *entry = dicomIndex->getEntry(dicomImageFiles[fileNumber]);
+        if(!entry || entry->seriesInstanceUID.empty())
+          continue;
+        SeriesKeyType seriesKey(entry->seriesInstanceUID, entry->frameOfReferenceUID);
+        series2files[seriesKey].push_back(fileNumber);
+
+        if(entry->imagePositionPatient.size() != 3)
+          continue;
+        typename ImageType::PointType ippPoint;
+        typename ImageType::IndexType ippIndex;
+        for(int j=0;j<3;j++)
+          ippPoint[j] = entry->imagePositionPatient[j];
+        if(image->TransformPhysicalPointToIndex(ippPoint, ippIndex))
+          series2slices[seriesKey].insert(ippIndex[2]);
+      }
+
+      cout << "Found " << series2files.size() << " series among " << dicomImageFiles.size() << " files" << endl;
+
+      SeriesKeyType selectedSeries;
+      size_t selectedSlices = 0;
+      for(map<SeriesKeyType, set<long> >::const_iterator sIt=series2slices.begin();sIt!=series2slices.end();++sIt){
+        if(sIt->second.size() > selectedSlices){
+          selectedSeries = sIt->first;
+          selectedSlices = sIt->second.size();
+        }
+      }
+
+      if(!selectedSlices){
+        cerr << "WARNING: none of the DICOM series matches the image geometry, all files will be used" << endl;
+        return dicomImageFiles;
+      }
+
+      const vector<size_t> &fileNumbers = series2files[selectedSeries];
+      cout << "Selected series " << selectedSeries.first << " (FoR " << selectedSeries.second << "), "
+           << fileNumbers.size() << " files covering " << selectedSlices << " slices" << endl;
+
+      vector<string> seriesFiles;
+      for(size_t i=0;i<fileNumbers.size();i++)
+        seriesFiles.push_back(dicomImageFiles[fileNumbers[i]]);
+      return seriesFiles;
+    }
+
   };
 
 }
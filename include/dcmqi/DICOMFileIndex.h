@@ -0,0 +1,70 @@
+#ifndef DCMQI_DICOMFILEINDEX_H
+#define DCMQI_DICOMFILEINDEX_H
+
+#include <json/json.h>
+
+// STD includes
+#include <map>
+#include <string>
+#include <vector>
+
+// DCMTK includes
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dcdatset.h>
+
+using namespace std;
+
+namespace dcmqi {
+
+  // Identifying and geometry attributes of scanned DICOM files, keyed by absolute path. The index can be kept
+  //  in a JSON file, so that repeated scans only parse the files that are new or were modified since.
+  class DICOMFileIndex {
+
+  public:
+    struct Entry {
+      double modificationTime;
+      double fileSize;
+      // empty for the files that could not be parsed as DICOM
+      string sopInstanceUID;
+      string seriesInstanceUID;
+      string studyInstanceUID;
+      string frameOfReferenceUID;
+      vector<double> imagePositionPatient;
+      vector<double> imageOrientationPatient;
+    };
+
+    typedef map<string, Entry> EntryMapType;
+
+    DICOMFileIndex();
+    DICOMFileIndex(const string &indexFileName);
+
+    // a missing index file is not an error, the index is empty in that case
+    bool read();
+    bool write() const;
+
+    // bring the entries of the given files up to date, and remove the entries of files under rootDirectories
+    //  that no longer exist; only the files that are not indexed yet, or whose modification time or size
+    //  changed, are parsed, using the given number of threads
+    void update(const vector<string> &fileNames, const vector<string> &rootDirectories=vector<string>(),
+                unsigned numberOfThreads=1);
+
+    // NULL if the file is not indexed
+    const Entry* getEntry(const string &fileName) const;
+    const EntryMapType& getEntries() const { return entries; }
+
+  protected:
+    // files are indexed by absolute path, so that the index does not depend on the working directory
+    static string getKey(const string &fileName);
+    static bool getFileStatus(const string &fileName, double &modificationTime, double &fileSize);
+    static void getEntryFromDataset(DcmDataset *dataset, Entry &entry);
+
+    static Json::Value entry2Json(const Entry &entry);
+    static Entry json2Entry(const Json::Value &value);
+
+    string indexFileName;
+    EntryMapType entries;
+  };
+}
+
+
+#endif //DCMQI_DICOMFILEINDEX_H
@@ -0,0 +1,65 @@
+#ifndef DCMQI_FRAMEGEOMETRYINDEX_H
+#define DCMQI_FRAMEGEOMETRYINDEX_H
+
+// STD includes
+#include <vector>
+
+// DCMTK includes
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmfg/fginterface.h>
+#include <dcmtk/dcmfg/fgplanpo.h>
+
+// ITK includes
+#include <vnl/vnl_vector.h>
+
+using namespace std;
+
+namespace dcmqi {
+
+  // Position of each frame of a multi-frame object along the slice direction. ImagePositionPatient is parsed
+  //  once per frame, and frames whose positions along the slice direction are within the tolerance are
+  //  considered to be at the same position.
+  class FrameGeometryIndex {
+
+  public:
+    FrameGeometryIndex();
+
+    // returns false if any of the frames is missing the per-frame PlanePositionPatient
+    bool build(FGInterface &fgInterface, const vnl_vector<double> &sliceDirection, double tolerance=1e-3);
+
+    size_t getNumberOfFrames() const { return frameDistances.size(); }
+    size_t getNumberOfPositions() const { return positionDistances.size(); }
+
+    // ImagePositionPatient of the frame
+    const double* getImagePosition(size_t frameNumber) const { return &imagePositions[3*frameNumber]; }
+    // distance of the frame from the first frame, along the slice direction
+    double getDistance(size_t frameNumber) const { return frameDistances[frameNumber]; }
+    // number of the distinct position of the frame, in increasing order of distance
+    unsigned getPositionNumber(size_t frameNumber) const { return framePositions[frameNumber]; }
+    // number of frames sharing the position of the frame
+    unsigned getOverlapCount(size_t frameNumber) const { return positionOverlaps[framePositions[frameNumber]]; }
+
+    // slice of the frame in a volume that starts at the lowest position and has the given slice spacing
+    unsigned getSliceNumber(size_t frameNumber, double sliceSpacing) const;
+
+    // frame at the lowest position; its ImagePositionPatient is the origin of the volume
+    size_t getOriginFrame() const { return originFrame; }
+    // distance between the two lowest positions, 0 if there is only one position
+    double getSliceSpacing() const;
+    // distance between the lowest and the highest position
+    double getExtent() const;
+    unsigned getNumberOfOverlappingPositions() const;
+
+  protected:
+    vector<double> imagePositions;
+    vector<double> frameDistances;
+    vector<unsigned> framePositions;
+    // distance of each distinct position (the lowest of its frames), in increasing order
+    vector<double> positionDistances;
+    vector<unsigned> positionOverlaps;
+    size_t originFrame;
+  };
+
+}
+
+#endif //DCMQI_FRAMEGEOMETRYINDEX_H
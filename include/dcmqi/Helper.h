@@ -43,7 +43,21 @@ namespace dcmqi {
 
     static string getFileExtensionFromType(const string& type);
     static vector<string> getFileListRecursively(string directory);
-    static vector<DcmDataset*> loadDatasets(const vector<string>& dicomImageFiles);
+    // maps SOPInstanceUID to the position of the dataset in the vector returned by loadDatasets()
+    typedef map<string, size_t> SOPInstanceUIDIndexType;
+
+    // read the given files using the given number of threads (0 selects the ITK default), stopping
+    //  before stopParsingAtElement; the result has one dataset per file, NULL for unreadable files
+    static vector<DcmDataset*> readDatasets(const vector<string>& dicomImageFiles, const DcmTagKey& stopParsingAtElement,
+                                            unsigned numberOfThreads=1);
+
+    // with headerOnly, parsing of each file stops before PixelData; files are read using the given
+    //  number of threads (0 selects the ITK default), the result is in the order of the file list
+    static vector<DcmDataset*> loadDatasets(const vector<string>& dicomImageFiles, bool headerOnly=false,
+                                            unsigned numberOfThreads=1);
+    static vector<DcmDataset*> loadDatasets(const vector<string>& dicomImageFiles,
+                                            SOPInstanceUIDIndexType& sopInstanceUIDIndex,
+                                            bool headerOnly=false, unsigned numberOfThreads=1);
 
     static string floatToStrScientific(float f);
     static void tokenizeString(string str, vector<string> &tokens, string delimiter);
@@ -64,6 +78,17 @@ namespace dcmqi {
     static void checkValidityOfFirstSrcImage(DcmSegmentation *segdoc);
 
     static CodeSequenceMacro* createNewCodeSequence(const string& code, const string& designator, const string& meaning);
+
+    // function processing a single work item of parallelFor(); must not throw
+    typedef void (*WorkItemFunction)(size_t workItem, void *userData);
+
+    // number of threads to use when numberOfThreads were requested; 0 selects the ITK default
+    static unsigned getNumberOfThreads(unsigned numberOfThreads);
+
+    // process work items 0..numberOfItems-1 using the given number of threads; each thread picks up
+    //  the next unprocessed item as soon as it is done with the previous one, so that items of uneven
+    //  cost are balanced across threads
+    static void parallelFor(size_t numberOfItems, unsigned numberOfThreads, WorkItemFunction function, void *userData);
   };
 
 }
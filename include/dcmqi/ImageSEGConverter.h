@@ -13,12 +13,12 @@
 #include <dcmtk/dcmseg/segment.h>
 #include <dcmtk/dcmseg/segutils.h>
 #include <dcmtk/dcmdata/dcrledrg.h>
+#include <dcmtk/dcmdata/dcrleenc.h>
+#include <dcmtk/dcmdata/dcpixseq.h>
+#include <dcmtk/dcmdata/dcpxitem.h>
 
 // ITK includes
-#include <itkImageDuplicator.h>
 #include <itkImageRegionConstIterator.h>
-#include <itkLabelStatisticsImageFilter.h>
-#include <itkBinaryThresholdImageFilter.h>
 #include <itkChangeInformationImageFilter.h>
 
 // DCMQI includes
@@ -27,9 +27,6 @@
 
 using namespace std;
 
-
-typedef itk::LabelImageToLabelMapFilter<ShortImageType> LabelToLabelMapFilterType;
-
 namespace dcmqi {
 
   class ImageSEGConverter : public ConverterBase {
@@ -38,13 +35,172 @@ namespace dcmqi {
     static DcmDataset* itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
                                                 vector<ShortImageType::Pointer> segmentations,
                                                 const string &metaData,
-                                                bool skipEmptySlices=true);
-
-
-    static pair <map<unsigned,ShortImageType::Pointer>, string> dcmSegmentation2itkimage(DcmDataset *segDataset);
+                                                bool skipEmptySlices=true,
+                                                unsigned numberOfThreads=0);
+    // writes the segmentation into the given dataset (e.g., the dataset of the DcmFileFormat that will be
+    //  saved), so that the encoded pixel data is not copied; returns false on failure
+    static bool itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
+                                         vector<ShortImageType::Pointer> segmentations,
+                                         const string &metaData,
+                                         DcmDataset &segdocDataset,
+                                         bool skipEmptySlices=true,
+                                         unsigned numberOfThreads=0);
+    // writes the segmentation to the given file in Explicit VR Little Endian; the header is written first, and
+    //  the frames are then encoded and appended to the file a few at a time, instead of being held in memory
+    static bool itkimage2dcmSegmentationFile(vector<DcmDataset*> dcmDatasets,
+                                             vector<ShortImageType::Pointer> segmentations,
+                                             const string &metaData,
+                                             const string &outputFileName,
+                                             bool skipEmptySlices=true,
+                                             unsigned numberOfThreads=0);
+
+    // re-encode the pixel data of a segmentation dataset written by itkimage2dcmSegmentation in RLE Lossless;
+    //  the frames are compressed in parallel, each of them padded to a byte boundary as required for
+    //  encapsulated 1-bit pixel data
+    static bool encodeRLE(DcmDataset &segdocDataset, unsigned numberOfThreads=0);
+
+
+    // mergeSegments: put non-overlapping segments into shared label images, numbered from 1
+    // cropSegments: crop each image to the bounding box of its non-empty pixels
+    // segmentFilter: decode only the segments matching one of the items (all if empty)
+    static pair <map<unsigned,ShortImageType::Pointer>, string> dcmSegmentation2itkimage(DcmDataset *segDataset,
+                                                                                         bool mergeSegments=false,
+                                                                                         bool cropSegments=false,
+                                                                                         const vector<string> &segmentFilter=vector<string>(),
+                                                                                         unsigned numberOfThreads=0);
 
  private:
 
+    // Extent of a single label value within the label image
+    struct LabelExtent {
+      // inclusive bounding box in image index space, ordered as
+      //  xmin, xmax, ymin, ymax, zmin, zmax (same as itk::LabelStatisticsImageFilter)
+      unsigned bbox[6];
+      // slices containing at least one pixel with this label value, in increasing order
+      vector<unsigned> nonEmptySlices;
+    };
+    typedef map<short, LabelExtent> LabelIndexType;
+
+    // walk the label image buffer once, and collect the extent of every non-zero label value
+    static LabelIndexType indexLabels(const ShortImageType::Pointer &labelImage);
+
+    // frame of a segment to be encoded by itkimage2dcmSegmentation
+    struct FrameEncodingItem {
+      ShortPixelType label;
+      Uint16 segmentNumber;
+      unsigned sliceNumber;
+      // value of the ImagePositionPatient dimension index for this frame
+      unsigned positionIndex;
+      // slice of the label image the frame is encoded from
+      const ShortPixelType *slicePixels;
+    };
+
+    // input and output of the frames encoded in parallel by encodeFrameWorkItem; each work item fills and packs
+    //  a group of 8 consecutive frames, which starts on a byte boundary of the packed data
+    struct FrameEncodingJob {
+      unsigned frameSize;
+      const FrameEncodingItem *frames;
+      size_t numberOfFrames;
+      Uint8 *packedData;
+    };
+
+    // builds the segmentation and writes it to segdocDataset without PixelData; the frames are not encoded, but
+    //  returned in the order of the document
+    static bool createSegmentation(vector<DcmDataset*> dcmDatasets,
+                                   vector<ShortImageType::Pointer> segmentations,
+                                   const string &metaData,
+                                   DcmDataset &segdocDataset,
+                                   bool skipEmptySlices,
+                                   vector<FrameEncodingItem> &frames);
+
+    // length of the native PixelData value holding numberOfFrames bit-packed frames; fails if it does not fit
+    //  in a DICOM element
+    static bool getPackedPixelDataLength(size_t numberOfFrames, unsigned frameSize, size_t &length);
+
+    // encode the given frames into the zero-initialized packedData, in the native bit-packed format; firstFrame
+    //  must be a multiple of 8, so that it starts on a byte boundary
+    static void encodeFrames(const vector<FrameEncodingItem> &frames, size_t firstFrame, size_t numberOfFrames,
+                             unsigned frameSize, Uint8 *packedData, unsigned numberOfThreads);
+
+    static void encodeFrameWorkItem(size_t groupNumber, void *job);
+
+    // input and output of the frames compressed in parallel by encodeRLEWorkItem
+    struct RLEEncodingJob {
+      const Uint8 *pixelData;
+      unsigned long pixelDataLength;
+      unsigned frameSize;
+      vector<vector<Uint8> > encodedFrames;
+    };
+
+    static void encodeRLEWorkItem(size_t frameNumber, void *job);
+
+    // replace the RLE Lossless pixel data of a binary segmentation dataset with native pixel data; DCMTK's RLE
+    //  decoder requires BitsAllocated to be a multiple of 8, so the byte-padded 1-bit frames are decoded here, in
+    //  parallel
+    static bool decodeRLE(DcmDataset &segDataset, unsigned numberOfThreads);
+
+    // input and output of the frames decompressed in parallel by decodeRLEWorkItem; a frame that cannot be
+    //  decoded is left empty
+    struct RLEDecodingJob {
+      unsigned frameSize;
+      vector<const Uint8*> encodedFrames;
+      vector<size_t> encodedFrameLengths;
+      vector<vector<Uint8> > decodedFrames;
+    };
+
+    static void decodeRLEWorkItem(size_t frameNumber, void *job);
+
+    // frame of a segment to be decoded by dcmSegmentation2itkimage
+    struct SegmentFrameItem {
+      size_t frameNumber;
+      Uint16 segmentNumber;
+      unsigned sliceNumber;
+    };
+
+    // frames written to the same slice of the same output image, decoded by decodeFrameWorkItem
+    struct FrameDecodingItem {
+      ShortPixelType *slicePixels;
+      ShortImageType::RegionType outputRegion;
+      vector<const DcmIODTypes::Frame*> frames;
+      vector<ShortPixelType> segmentNumbers;
+    };
+
+    // input of the frames decoded in parallel by decodeFrameWorkItem; no two items write to the same slice
+    struct FrameDecodingJob {
+      unsigned columns;
+      bool isBinary;
+      vector<FrameDecodingItem> items;
+    };
+
+    static void decodeFrameWorkItem(size_t itemNumber, void *job);
+
+    // numbers of the segments matching any of the items of the segment filter
+    static set<Uint16> selectSegments(DcmSegmentation *segdoc, const vector<string> &segmentFilter);
+
+    // assign each segment to a layer (numbered from 1), so that segments of the same layer do not overlap
+    static map<Uint16,unsigned> assignSegmentLayers(DcmSegmentation *segdoc,
+                                                    const vector<SegmentFrameItem> &segmentFrames,
+                                                    size_t frameSize, bool isBinary);
+    static bool framesOverlap(const DcmIODTypes::Frame *frame1, const DcmIODTypes::Frame *frame2,
+                              size_t frameSize, bool isBinary);
+
+    // region of the volume covered by the non-empty pixels of each output image of dcmSegmentation2itkimage
+    static map<unsigned,ShortImageType::RegionType> getOutputRegions(DcmSegmentation *segdoc,
+                                                                     const vector<SegmentFrameItem> &segmentFrames,
+                                                                     map<Uint16,unsigned> &segment2output,
+                                                                     const ShortImageType::SizeType &imageSize,
+                                                                     bool isBinary);
+
+    // set the pixels that are set in the bit-packed binary frame, starting at firstBit, to value, leaving the
+    //  others unchanged
+    static void unpackBinaryPixels(const Uint8 *packedFrame, const size_t firstBit, const unsigned numberOfPixels,
+                                   const ShortPixelType value, ShortPixelType *pixels);
+
+    // set the bits of packedData starting at firstBit where the pixels equal the label, in the DICOM bit order
+    //  (first pixel in the least significant bit); packedData must be zero-initialized
+    static void packBinaryPixels(const ShortPixelType *pixels, const ShortPixelType label, const size_t numberOfPixels,
+                                 const unsigned firstBit, Uint8 *packedData);
+
     static void populateMetaInformationFromDICOM(DcmDataset *segDataset, DcmSegmentation *segdoc,
                                                  JSONSegmentationMetaInformationHandler &metaInfo);
   };
@@ -15,7 +15,6 @@
 
 // ITK includes
 #include <itkImageRegionConstIteratorWithIndex.h>
-#include <itkMinimumMaximumImageCalculator.h>
 
 // DCMQI includes
 #include "dcmqi/ConverterBase.h"
@@ -24,7 +23,11 @@
 typedef IODFloatingPointImagePixelModule::value_type FloatPixelType;
 typedef itk::Image<FloatPixelType, 3> FloatImageType;
 typedef itk::ImageFileReader<FloatImageType> FloatReaderType;
-typedef itk::MinimumMaximumImageCalculator<FloatImageType> MinMaxCalculatorType;
+typedef itk::Image<FloatPixelType, 4> Float4DImageType;
+typedef itk::ImageFileReader<Float4DImageType> Float4DReaderType;
+typedef IODDoubleFloatingPointImagePixelModule::value_type DoublePixelType;
+typedef itk::Image<DoublePixelType, 3> DoubleImageType;
+typedef itk::ImageFileReader<DoubleImageType> DoubleReaderType;
 
 using namespace std;
 
@@ -34,15 +37,70 @@ namespace dcmqi {
   class ParaMapConverter : public ConverterBase {
 
   public:
+    // pixelType is one of "float", "uint16" or "int16" (double precision input has its own overload); unless the
+    //  input values are integers within the range of the integer type, they are scaled to its full range, and the
+    //  scaling is added to the RWVM slope and intercept
     static DcmDataset* itkimage2paramap(const FloatImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
+                                        const string &metaData, const string &pixelType="float");
+    // the volumes along the 4th dimension (time, b-value, or any other parameter) are stored as the frames of a
+    //  single parametric map, told apart by the TemporalPositionIndex dimension
+    static DcmDataset* itkimage2paramap(const Float4DImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
+                                        const string &metaData, const string &pixelType="float");
+    // the pixel values are stored in double precision
+    static DcmDataset* itkimage2paramap(const DoubleImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
                                         const string &metaData);
 
-    static pair <FloatImageType::Pointer, string> paramap2itkimage(DcmDataset *pmapDataset);
+    // the frames of any of the supported pixel types are converted to float; the real world value mapping is
+    //  applied to integer pixel values only; the frames are copied into the image using the given number of threads
+    static pair <FloatImageType::Pointer, string> paramap2itkimage(DcmDataset *pmapDataset, unsigned numberOfThreads=0);
+    // the volumes are ordered by TemporalPositionIndex; maps without it are read as a single volume
+    static pair <Float4DImageType::Pointer, string> paramap2itkimage4D(DcmDataset *pmapDataset, unsigned numberOfThreads=0);
+    // the first volume of the 4D image (e.g., of a parametric map with a single volume), sharing its pixel buffer
+    static FloatImageType::Pointer getFirstVolume(const Float4DImageType::Pointer &pmImage4D);
   protected:
-    static OFCondition addFrame(DPMParametricMapIOD &map, const FloatImageType::Pointer &parametricMapImage,
-                                const JSONParametricMapMetaInformationHandler &metaInfo, const unsigned long frameNo, OFVector<FGBase*> perFrameGroups);
+    // ImagePixelModule selects the pixel type stored in the parametric map; the volumes must share the same
+    //  geometry, and are encoded with a second dimension index if there are more than one
+    template <class ImageType, class ImagePixelModule>
+    static DcmDataset* createParametricMap(const vector<typename ImageType::Pointer> &volumes,
+                                           vector<DcmDataset*> dcmDatasets, const string &metaData);
+    // 3D view of the given volume of the 4D image, sharing its pixel buffer; the volumes after the first one
+    //  only refer to the buffer, which must outlive them
+    static FloatImageType::Pointer getVolume(const Float4DImageType::Pointer &image4D, size_t volumeNumber);
+    static DcmDataset* createFloatParametricMap(const vector<FloatImageType::Pointer> &volumes,
+                                                vector<DcmDataset*> dcmDatasets,
+                                                const string &metaData, const string &pixelType);
 
-    static void populateMetaInformationFromDICOM(DcmDataset *pmapDataset,
+    // slice of the image, and the frame copied to it by copyFrameWorkItem (NULL if there is no frame at this
+    //  position)
+    struct FrameCopyItem {
+      FloatPixelType *slicePixels;
+      const void *frame;
+    };
+
+    // input of the frames copied in parallel by copyFrameWorkItem; one item per slice
+    struct FrameCopyJob {
+      size_t frameSize;
+      vector<FrameCopyItem> items;
+      // real world value mapping applied to integer stored values
+      Float64 slope, intercept;
+      // converts the frame pixels from the stored pixel type
+      void (*copyPixels)(const void *frame, size_t numberOfPixels, double slope, double intercept,
+                         FloatPixelType *slicePixels);
+    };
+
+    // assign the frames to the items of the job (frameSlices holding the item of each frame), if the parametric
+    //  map has the given stored pixel type
+    template <class StoredPixelType>
+    static bool getFramePixels(DPMParametricMapIOD::FramesType &frames, const vector<size_t> &frameSlices,
+                               FrameCopyJob &job);
+    template <class StoredPixelType>
+    static void copyFramePixels(const void *frame, size_t numberOfPixels, double slope, double intercept,
+                                FloatPixelType *slicePixels);
+
+    static void copyFrameWorkItem(size_t sliceNumber, void *job);
+
+    // pMapDoc is the parametric map already loaded from pmapDataset
+    static void populateMetaInformationFromDICOM(DcmDataset *pmapDataset, DPMParametricMapIOD *pMapDoc,
                                                  JSONParametricMapMetaInformationHandler &metaInfo);
   };
 
@@ -0,0 +1,201 @@
+
+// STD includes
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// ITK includes
+#include <itksys/SystemTools.hxx>
+
+// DCMQI includes
+#include "dcmqi/DICOMFileIndex.h"
+#include "dcmqi/Helper.h"
+
+namespace dcmqi {
+
+  DICOMFileIndex::DICOMFileIndex() {
+  }
+
+  DICOMFileIndex::DICOMFileIndex(const string &indexFileName) : indexFileName(indexFileName) {
+  }
+
+  bool DICOMFileIndex::read() {
+    entries.clear();
+    ifstream indexStream(indexFileName.c_str(), ios_base::binary);
+    if(!indexStream.is_open())
+      return true;
+
+    Json::Value root;
+    Json::Reader reader;
+    if(!reader.parse(indexStream, root) || !root.isMember("files")){
+      cerr << "WARNING: failed to parse DICOM index " << indexFileName << ", it will be rebuilt" << endl;
+      return false;
+    }
+
+    // entries are keyed by absolute path; others (from older versions of the index) are dropped
+    const Json::Value &files = root["files"];
+    for(Json::Value::const_iterator fIt=files.begin();fIt!=files.end();++fIt)
+      if(itksys::SystemTools::FileIsFullPath(fIt.key().asString()))
+        entries[fIt.key().asString()] = json2Entry(*fIt);
+
+    cout << "Read " << entries.size() << " entries from DICOM index " << indexFileName << endl;
+    return true;
+  }
+
+  bool DICOMFileIndex::write() const {
+    Json::Value root;
+    root["files"] = Json::Value(Json::objectValue);
+    for(EntryMapType::const_iterator eIt=entries.begin();eIt!=entries.end();++eIt)
+      root["files"][eIt->first] = entry2Json(eIt->second);
+
+    ofstream outputFile(indexFileName.c_str());
+    if(!outputFile.is_open()){
+      cerr << "ERROR: failed to write DICOM index " << indexFileName << endl;
+      return false;
+    }
+    Json::FastWriter writer;
+    outputFile << writer.write(root);
+    outputFile.close();
+    if(outputFile.fail()){
+      cerr << "ERROR: failed to write DICOM index " << indexFileName << endl;
+      return false;
+    }
+    return true;
+  }
+
+  void DICOMFileIndex::update(const vector<string> &inputFileNames, const vector<string> &rootDirectories,
+                              unsigned numberOfThreads) {
+    vector<string> fileNames;
+    for(size_t fileNumber=0;fileNumber<inputFileNames.size();fileNumber++)
+      fileNames.push_back(getKey(inputFileNames[fileNumber]));
+
+    vector<string> filesToParse;
+    vector<Entry> entriesToParse;
+
+    // only the entries under the scanned directories are checked for files that no longer exist; entries of
+    //  the other files are left alone, so that the index can be shared between inputs
+    set<string> fileNameSet(fileNames.begin(), fileNames.end());
+    size_t removedEntries = 0, upToDateFiles = 0;
+    for(size_t rootNumber=0;rootNumber<rootDirectories.size();rootNumber++){
+      string rootPrefix = getKey(rootDirectories[rootNumber]);
+      if(rootPrefix.empty() || rootPrefix[rootPrefix.size()-1] != '/')
+        rootPrefix += "/";
+      for(EntryMapType::iterator eIt=entries.lower_bound(rootPrefix);
+          eIt!=entries.end() && eIt->first.compare(0, rootPrefix.size(), rootPrefix) == 0;){
+        double modificationTime, fileSize;
+        if(fileNameSet.find(eIt->first) == fileNameSet.end() && !getFileStatus(eIt->first, modificationTime, fileSize)){
+          entries.erase(eIt++);
+          removedEntries++;
+        } else {
+          ++eIt;
+        }
+      }
+    }
+
+    for(size_t fileNumber=0;fileNumber<fileNames.size();fileNumber++){
+      const string &fileName = fileNames[fileNumber];
+      Entry entry;
+      if(!getFileStatus(fileName, entry.modificationTime, entry.fileSize)){
+        removedEntries += entries.erase(fileName);
+        continue;
+      }
+      EntryMapType::const_iterator eIt = entries.find(fileName);
+      if(eIt != entries.end() && eIt->second.modificationTime == entry.modificationTime &&
+         eIt->second.fileSize == entry.fileSize){
+        upToDateFiles++;
+        continue;
+      }
+      filesToParse.push_back(fileName);
+      entriesToParse.push_back(entry);
+    }
+
+    // all of the indexed attributes precede the PositionReferenceIndicator
+    vector<DcmDataset*> headers = Helper::readDatasets(filesToParse, DCM_PositionReferenceIndicator, numberOfThreads);
+    for(size_t fileNumber=0;fileNumber<filesToParse.size();fileNumber++){
+      if(headers[fileNumber]){
+        getEntryFromDataset(headers[fileNumber], entriesToParse[fileNumber]);
+        delete headers[fileNumber];
+      }
+      entries[filesToParse[fileNumber]] = entriesToParse[fileNumber];
+    }
+
+    cout << "DICOM index: " << filesToParse.size() << " new or modified files parsed, " <<
+      upToDateFiles << " files up to date, " << removedEntries <<
+      " entries of removed files dropped" << endl;
+  }
+
+  const DICOMFileIndex::Entry* DICOMFileIndex::getEntry(const string &fileName) const {
+    EntryMapType::const_iterator eIt = entries.find(getKey(fileName));
+    if(eIt == entries.end())
+      return NULL;
+    return &eIt->second;
+  }
+
+  string DICOMFileIndex::getKey(const string &fileName) {
+    return itksys::SystemTools::CollapseFullPath(fileName);
+  }
+
+  bool DICOMFileIndex::getFileStatus(const string &fileName, double &modificationTime, double &fileSize) {
+    struct stat buffer;
+    if(stat(fileName.c_str(), &buffer) != 0)
+      return false;
+    modificationTime = double(buffer.st_mtime);
+    fileSize = double(buffer.st_size);
+    return true;
+  }
+
+  void DICOMFileIndex::getEntryFromDataset(DcmDataset *dataset, Entry &entry) {
+    OFString value;
+    if(dataset->findAndGetOFString(DCM_SOPInstanceUID, value).good())
+      entry.sopInstanceUID = value.c_str();
+    if(dataset->findAndGetOFString(DCM_SeriesInstanceUID, value).good())
+      entry.seriesInstanceUID = value.c_str();
+    if(dataset->findAndGetOFString(DCM_StudyInstanceUID, value).good())
+      entry.studyInstanceUID = value.c_str();
+    if(dataset->findAndGetOFString(DCM_FrameOfReferenceUID, value).good())
+      entry.frameOfReferenceUID = value.c_str();
+
+    Float64 component;
+    for(unsigned long i=0;dataset->findAndGetFloat64(DCM_ImagePositionPatient, component, i).good();i++)
+      entry.imagePositionPatient.push_back(component);
+    for(unsigned long i=0;dataset->findAndGetFloat64(DCM_ImageOrientationPatient, component, i).good();i++)
+      entry.imageOrientationPatient.push_back(component);
+  }
+
+  Json::Value DICOMFileIndex::entry2Json(const Entry &entry) {
+    Json::Value value;
+    value["mtime"] = entry.modificationTime;
+    value["size"] = entry.fileSize;
+    value["SOPInstanceUID"] = entry.sopInstanceUID;
+    value["SeriesInstanceUID"] = entry.seriesInstanceUID;
+    value["StudyInstanceUID"] = entry.studyInstanceUID;
+    value["FrameOfReferenceUID"] = entry.frameOfReferenceUID;
+    value["ImagePositionPatient"] = Json::Value(Json::arrayValue);
+    for(size_t i=0;i<entry.imagePositionPatient.size();i++)
+      value["ImagePositionPatient"].append(entry.imagePositionPatient[i]);
+    value["ImageOrientationPatient"] = Json::Value(Json::arrayValue);
+    for(size_t i=0;i<entry.imageOrientationPatient.size();i++)
+      value["ImageOrientationPatient"].append(entry.imageOrientationPatient[i]);
+    return value;
+  }
+
+  DICOMFileIndex::Entry DICOMFileIndex::json2Entry(const Json::Value &value) {
+    Entry entry;
+    entry.modificationTime = value.get("mtime", -1.).asDouble();
+    entry.fileSize = value.get("size", -1.).asDouble();
+    entry.sopInstanceUID = value.get("SOPInstanceUID", "").asString();
+    entry.seriesInstanceUID = value.get("SeriesInstanceUID", "").asString();
+    entry.studyInstanceUID = value.get("StudyInstanceUID", "").asString();
+    entry.frameOfReferenceUID = value.get("FrameOfReferenceUID", "").asString();
+    const Json::Value &ipp = value["ImagePositionPatient"];
+    for(Json::ArrayIndex i=0;i<ipp.size();i++)
+      entry.imagePositionPatient.push_back(ipp[i].asDouble());
+    const Json::Value &iop = value["ImageOrientationPatient"];
+    for(Json::ArrayIndex i=0;i<iop.size();i++)
+      entry.imageOrientationPatient.push_back(iop[i].asDouble());
+    return entry;
+  }
+
+}
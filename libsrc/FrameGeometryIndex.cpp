@@ -0,0 +1,105 @@
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// DCMQI includes
+#include "dcmqi/FrameGeometryIndex.h"
+
+namespace dcmqi {
+
+  // orders frame numbers by distance, keeping the frame order for equal distances
+  struct FrameDistanceLess {
+    const vector<double> &distances;
+    FrameDistanceLess(const vector<double> &distances) : distances(distances) {}
+    bool operator()(size_t frame1, size_t frame2) const { return distances[frame1] < distances[frame2]; }
+  };
+
+  FrameGeometryIndex::FrameGeometryIndex() : originFrame(0) {
+  }
+
+  bool FrameGeometryIndex::build(FGInterface &fgInterface, const vnl_vector<double> &sliceDirection,
+                                 double tolerance) {
+    const size_t numFrames = fgInterface.getNumberOfFrames();
+    imagePositions.assign(3*numFrames, 0);
+    frameDistances.assign(numFrames, 0);
+    framePositions.assign(numFrames, 0);
+    positionDistances.clear();
+    positionOverlaps.clear();
+    originFrame = 0;
+
+    for(size_t frameId=0;frameId<numFrames;frameId++){
+      OFBool isPerFrame;
+      FGPlanePosPatient *planposfg = OFstatic_cast(FGPlanePosPatient*,
+                                                   fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
+      if(!planposfg){
+        cerr << "PlanePositionPatient is missing" << endl;
+        return false;
+      }
+      if(!isPerFrame){
+        cerr << "PlanePositionPatient is required for each frame!" << endl;
+        return false;
+      }
+
+      for(int j=0;j<3;j++){
+        OFString planposStr;
+        if(planposfg->getImagePositionPatient(planposStr, j).bad()){
+          cerr << "Failed to read patient position" << endl;
+          return false;
+        }
+        imagePositions[3*frameId+j] = atof(planposStr.c_str());
+      }
+
+      for(int j=0;j<3;j++)
+        frameDistances[frameId] += (imagePositions[3*frameId+j]-imagePositions[j])*sliceDirection[j];
+    }
+
+    if(!numFrames)
+      return true;
+
+    vector<size_t> sortedFrames(numFrames);
+    for(size_t frameId=0;frameId<numFrames;frameId++)
+      sortedFrames[frameId] = frameId;
+    stable_sort(sortedFrames.begin(), sortedFrames.end(), FrameDistanceLess(frameDistances));
+
+    // merge the frames within the tolerance of the lowest frame of each position
+    originFrame = sortedFrames[0];
+    for(size_t i=0;i<numFrames;i++){
+      const size_t frameId = sortedFrames[i];
+      if(positionDistances.empty() || frameDistances[frameId]-positionDistances.back() > tolerance){
+        positionDistances.push_back(frameDistances[frameId]);
+        positionOverlaps.push_back(0);
+      }
+      framePositions[frameId] = positionDistances.size()-1;
+      positionOverlaps.back()++;
+    }
+
+    return true;
+  }
+
+  unsigned FrameGeometryIndex::getSliceNumber(size_t frameNumber, double sliceSpacing) const {
+    return unsigned(floor((frameDistances[frameNumber]-positionDistances[0])/sliceSpacing+0.5));
+  }
+
+  double FrameGeometryIndex::getSliceSpacing() const {
+    if(positionDistances.size() < 2)
+      return 0;
+    return positionDistances[1]-positionDistances[0];
+  }
+
+  double FrameGeometryIndex::getExtent() const {
+    if(positionDistances.empty())
+      return 0;
+    return positionDistances.back()-positionDistances[0];
+  }
+
+  unsigned FrameGeometryIndex::getNumberOfOverlappingPositions() const {
+    unsigned overlappingPositions = 0;
+    for(size_t i=0;i<positionOverlaps.size();i++)
+      if(positionOverlaps[i] > 1)
+        overlappingPositions++;
+    return overlappingPositions;
+  }
+
+}
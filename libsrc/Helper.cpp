@@ -1,9 +1,51 @@
 
+// ITK includes
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+
 // DCMQI includes
 #include "dcmqi/Helper.h"
 
 namespace dcmqi {
 
+  // state shared by the threads of Helper::parallelFor()
+  struct ParallelForData {
+    size_t numberOfItems;
+    size_t nextItem;
+    itk::SimpleFastMutexLock nextItemLock;
+    Helper::WorkItemFunction function;
+    void *userData;
+  };
+
+  static ITK_THREAD_RETURN_TYPE parallelForThreadCallback(void *arg) {
+    itk::MultiThreader::ThreadInfoStruct *threadInfo = static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    ParallelForData *data = static_cast<ParallelForData*>(threadInfo->UserData);
+    while(true){
+      data->nextItemLock.Lock();
+      size_t item = data->nextItem++;
+      data->nextItemLock.Unlock();
+      if(item >= data->numberOfItems)
+        break;
+      data->function(item, data->userData);
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  // input and output of the work items of Helper::readDatasets()
+  struct LoadDatasetsJob {
+    const vector<string> *fileNames;
+    DcmTagKey stopParsingAtElement;
+    vector<DcmDataset*> datasets;
+  };
+
+  static void loadDatasetWorkItem(size_t fileNumber, void *userData) {
+    LoadDatasetsJob *job = static_cast<LoadDatasetsJob*>(userData);
+    DcmFileFormat sliceFF;
+    if(sliceFF.loadFileUntilTag((*job->fileNames)[fileNumber].c_str(), EXS_Unknown, EGL_noChange,
+                                DCM_MaxReadLength, ERM_autoDetect, job->stopParsingAtElement).good())
+      job->datasets[fileNumber] = sliceFF.getAndRemoveDataset();
+  }
+
   bool Helper::isUndefinedOrPathDoesNotExist(const string &var, const string &humanReadableName) {
     return Helper::isUndefined(var, humanReadableName) || !Helper::pathExists(var);
   }
@@ -64,32 +106,49 @@ namespace dcmqi {
     return dicomImageFiles;
   }
 
-  vector<DcmDataset*> Helper::loadDatasets(const vector<string>& dicomImageFiles) {
+  vector<DcmDataset*> Helper::readDatasets(const vector<string>& dicomImageFiles, const DcmTagKey& stopParsingAtElement,
+                                           unsigned numberOfThreads) {
+    LoadDatasetsJob job;
+    job.fileNames = &dicomImageFiles;
+    job.stopParsingAtElement = stopParsingAtElement;
+    job.datasets.resize(dicomImageFiles.size(), NULL);
+    parallelFor(dicomImageFiles.size(), numberOfThreads, &loadDatasetWorkItem, &job);
+    return job.datasets;
+  }
+
+  vector<DcmDataset*> Helper::loadDatasets(const vector<string>& dicomImageFiles, bool headerOnly,
+                                           unsigned numberOfThreads) {
+    SOPInstanceUIDIndexType sopInstanceUIDIndex;
+    return loadDatasets(dicomImageFiles, sopInstanceUIDIndex, headerOnly, numberOfThreads);
+  }
+
+  vector<DcmDataset*> Helper::loadDatasets(const vector<string>& dicomImageFiles,
+                                           SOPInstanceUIDIndexType& sopInstanceUIDIndex,
+                                           bool headerOnly, unsigned numberOfThreads) {
+    // files are read concurrently, duplicates are then resolved sequentially in the order of the list,
+    //  so the result does not depend on the number of threads
+    // the converters only use attributes preceding the pixel data, which does not need to be read
+    vector<DcmDataset*> fileDatasets = readDatasets(dicomImageFiles, headerOnly ? DCM_PixelData : DCM_UndefinedTagKey,
+                                                    numberOfThreads);
+
     vector<DcmDataset*> dcmDatasets;
-    OFString tmp, sopInstanceUID;
-    DcmFileFormat* sliceFF = new DcmFileFormat();
+    OFString sopInstanceUID;
+    sopInstanceUIDIndex.clear();
     for(size_t dcmFileNumber=0; dcmFileNumber<dicomImageFiles.size(); dcmFileNumber++){
-      if(sliceFF->loadFile(dicomImageFiles[dcmFileNumber].c_str()).good()){
-        DcmDataset* currentDataset = sliceFF->getAndRemoveDataset();
+      DcmDataset* currentDataset = fileDatasets[dcmFileNumber];
+      if(currentDataset){
         currentDataset->findAndGetOFString(DCM_SOPInstanceUID, sopInstanceUID);
-        bool exists = false;
-        for(size_t i=0;i<dcmDatasets.size();i++) {
-          dcmDatasets[i]->findAndGetOFString(DCM_SOPInstanceUID, tmp);
-          if (tmp == sopInstanceUID) {
-            cout << dicomImageFiles[dcmFileNumber].c_str() << " with SOPInstanceUID: " << sopInstanceUID
-                 << " already exists" << endl;
-            exists = true;
-            break;
-          }
-        }
-        if (!exists) {
+        if(sopInstanceUIDIndex.insert(make_pair(string(sopInstanceUID.c_str()), dcmDatasets.size())).second) {
           dcmDatasets.push_back(currentDataset);
+        } else {
+          cout << dicomImageFiles[dcmFileNumber].c_str() << " with SOPInstanceUID: " << sopInstanceUID
+               << " already exists" << endl;
+          delete currentDataset;
         }
       } else {
         cerr << "Failed to read " << dicomImageFiles[dcmFileNumber] << ". Skipping it." << endl;
       }
     }
-    delete sliceFF;
     return dcmDatasets;
   }
 
@@ -368,5 +427,34 @@ namespace dcmqi {
     return new CodeSequenceMacro(code.c_str(), designator.c_str(), meaning.c_str());
   }
 
+  unsigned Helper::getNumberOfThreads(unsigned numberOfThreads) {
+    if(numberOfThreads == 0)
+      numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    return std::max(1u, std::min(numberOfThreads, unsigned(itk::MultiThreader::GetGlobalMaximumNumberOfThreads())));
+  }
+
+  void Helper::parallelFor(size_t numberOfItems, unsigned numberOfThreads, WorkItemFunction function, void *userData) {
+    numberOfThreads = getNumberOfThreads(numberOfThreads);
+    if(numberOfThreads > numberOfItems)
+      numberOfThreads = unsigned(numberOfItems);
+
+    // no need to spin up threads for a single worker
+    if(numberOfThreads <= 1){
+      for(size_t item=0;item<numberOfItems;item++)
+        function(item, userData);
+      return;
+    }
+
+    ParallelForData data;
+    data.numberOfItems = numberOfItems;
+    data.nextItem = 0;
+    data.function = function;
+    data.userData = userData;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numberOfThreads);
+    threader->SetSingleMethod(parallelForThreadCallback, &data);
+    threader->SingleMethodExecute();
+  }
 
 }
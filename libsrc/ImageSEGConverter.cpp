@@ -1,14 +1,271 @@
 
+// STD includes
+#include <cstring>
+#include <fstream>
+
+// ITK includes
+#include <itkIntTypes.h>
+
 // DCMQI includes
 #include "dcmqi/ImageSEGConverter.h"
 
 
 namespace dcmqi {
 
+  // bits 0-3 set where the 4 pixels equal the label, which is repeated in the 4 16-bit lanes of labels; the
+  //  pixels are compared at once, as the lanes of a 64-bit word
+  static inline unsigned matchLabelBits(const ShortPixelType *pixels, const itk::uint64_t labels) {
+    const itk::uint64_t lowBits = 0x7FFF7FFF7FFF7FFFULL;
+    const itk::uint64_t lanes = itk::uint64_t(Uint16(pixels[0])) | (itk::uint64_t(Uint16(pixels[1])) << 16) |
+                                (itk::uint64_t(Uint16(pixels[2])) << 32) | (itk::uint64_t(Uint16(pixels[3])) << 48);
+    const itk::uint64_t difference = lanes ^ labels;
+    // the top bit of each lane is set if the lane is zero
+    const itk::uint64_t zeroLanes = ~(((difference & lowBits) + lowBits) | difference | lowBits);
+    // gather the top bits of the lanes into bits 48-51
+    return unsigned(((zeroLanes >> 15) * 0x0001000200040008ULL) >> 48) & 0xF;
+  }
+
   DcmDataset* ImageSEGConverter::itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
                                                           vector<ShortImageType::Pointer> segmentations,
                                                           const string &metaData,
-                                                          bool skipEmptySlices) {
+                                                          bool skipEmptySlices,
+                                                          unsigned numberOfThreads) {
+    DcmDataset* segdocDataset = new DcmDataset();
+    if(!itkimage2dcmSegmentation(dcmDatasets, segmentations, metaData, *segdocDataset, skipEmptySlices, numberOfThreads)){
+      delete segdocDataset;
+      return NULL;
+    }
+    return segdocDataset;
+  }
+
+  bool ImageSEGConverter::itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
+                                                   vector<ShortImageType::Pointer> segmentations,
+                                                   const string &metaData,
+                                                   DcmDataset &segdocDataset,
+                                                   bool skipEmptySlices,
+                                                   unsigned numberOfThreads) {
+    vector<FrameEncodingItem> frames;
+    if(!createSegmentation(dcmDatasets, segmentations, metaData, segdocDataset, skipEmptySlices, frames))
+      return false;
+
+    ShortImageType::SizeType inputSize = segmentations[0]->GetBufferedRegion().GetSize();
+    const unsigned frameSize = inputSize[0] * inputSize[1];
+
+    size_t pixelDataLength;
+    if(!getPackedPixelDataLength(frames.size(), frameSize, pixelDataLength))
+      return false;
+
+    // all frames are encoded in a single pass, directly into the pixel data of the dataset
+    DcmPixelData *pixelData = new DcmPixelData(DCM_PixelData);
+    Uint8 *packedData;
+    CHECK_COND(pixelData->createUint8Array(Uint32(pixelDataLength), packedData));
+    memset(packedData, 0, pixelDataLength);
+    pixelData->setVR(EVR_OB);
+    encodeFrames(frames, 0, frames.size(), frameSize, packedData, numberOfThreads);
+    CHECK_COND(segdocDataset.insert(pixelData, OFTrue));
+
+    return true;
+  }
+
+  bool ImageSEGConverter::itkimage2dcmSegmentationFile(vector<DcmDataset*> dcmDatasets,
+                                                       vector<ShortImageType::Pointer> segmentations,
+                                                       const string &metaData,
+                                                       const string &outputFileName,
+                                                       bool skipEmptySlices,
+                                                       unsigned numberOfThreads) {
+    DcmFileFormat segdocFF;
+    vector<FrameEncodingItem> frames;
+    if(!createSegmentation(dcmDatasets, segmentations, metaData, *segdocFF.getDataset(), skipEmptySlices, frames))
+      return false;
+
+    ShortImageType::SizeType inputSize = segmentations[0]->GetBufferedRegion().GetSize();
+    const unsigned frameSize = inputSize[0] * inputSize[1];
+
+    size_t pixelDataLength;
+    if(!getPackedPixelDataLength(frames.size(), frameSize, pixelDataLength))
+      return false;
+
+    // everything up to PixelData, which is the last element of the dataset; there are no group lengths,
+    //  since the length of the pixel data group is not known when the header is written
+    if(segdocFF.saveFile(outputFileName.c_str(), EXS_LittleEndianExplicit, EET_ExplicitLength, EGL_withoutGL).bad()){
+      cerr << "ERROR: Failed to write the segmentation header to " << outputFileName << endl;
+      return false;
+    }
+
+    ofstream outputStream(outputFileName.c_str(), ios_base::binary | ios_base::app);
+
+    // PixelData element header, explicit VR little endian: tag, VR, reserved, 32-bit length
+    const Uint8 pixelDataHeader[12] = {
+      0xE0, 0x7F, 0x10, 0x00, 'O', 'B', 0x00, 0x00,
+      Uint8(pixelDataLength), Uint8(pixelDataLength >> 8), Uint8(pixelDataLength >> 16), Uint8(pixelDataLength >> 24)};
+    outputStream.write(reinterpret_cast<const char*>(pixelDataHeader), sizeof(pixelDataHeader));
+
+    // frames are encoded and appended to the file in batches; a batch is a whole number of groups of 8 frames,
+    //  so that each batch starts on a byte boundary
+    numberOfThreads = Helper::getNumberOfThreads(numberOfThreads);
+    const size_t framesPerBatch = 8*4*numberOfThreads;
+    vector<Uint8> packedData(framesPerBatch*frameSize/8);
+
+    for(size_t batchStart=0;batchStart<frames.size();batchStart+=framesPerBatch){
+      const size_t batchFrames = min(frames.size()-batchStart, framesPerBatch);
+      fill(packedData.begin(), packedData.end(), 0);
+      encodeFrames(frames, batchStart, batchFrames, frameSize, &packedData[0], numberOfThreads);
+      outputStream.write(reinterpret_cast<const char*>(&packedData[0]), (batchFrames*frameSize+7)/8);
+    }
+
+    if((frames.size()*frameSize+7)/8 < pixelDataLength)
+      outputStream.put(0);
+
+    outputStream.close();
+    if(outputStream.fail()){
+      cerr << "ERROR: Failed to write the segmentation frames to " << outputFileName << endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  bool ImageSEGConverter::getPackedPixelDataLength(size_t numberOfFrames, unsigned frameSize, size_t &length) {
+    // frames are packed one after another without padding, and the value is padded to even length
+    const size_t pixelDataBytes = (numberOfFrames*frameSize+7)/8;
+    length = pixelDataBytes + (pixelDataBytes & 1);
+    if(length > 0xFFFFFFFEUL){
+      cerr << "ERROR: Pixel data of " << numberOfFrames << " frames exceeds the maximum length of a DICOM element!" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  void ImageSEGConverter::encodeFrames(const vector<FrameEncodingItem> &frames, size_t firstFrame, size_t numberOfFrames,
+                                       unsigned frameSize, Uint8 *packedData, unsigned numberOfThreads) {
+    assert(firstFrame%8 == 0);
+    if(!numberOfFrames)
+      return;
+
+    FrameEncodingJob job;
+    job.frames = &frames[firstFrame];
+    job.numberOfFrames = numberOfFrames;
+    job.frameSize = frameSize;
+    job.packedData = packedData;
+    Helper::parallelFor((numberOfFrames+7)/8, numberOfThreads, &encodeFrameWorkItem, &job);
+  }
+
+  bool ImageSEGConverter::encodeRLE(DcmDataset &segdocDataset, unsigned numberOfThreads) {
+    Uint16 rows, columns;
+    Sint32 numberOfFrames;
+    Uint8 *pixelData;
+    unsigned long pixelDataLength;
+    DcmElement *pixelDataElement;
+    if(segdocDataset.findAndGetUint16(DCM_Rows, rows).bad() ||
+       segdocDataset.findAndGetUint16(DCM_Columns, columns).bad() ||
+       segdocDataset.findAndGetSint32(DCM_NumberOfFrames, numberOfFrames).bad() ||
+       segdocDataset.findAndGetElement(DCM_PixelData, pixelDataElement).bad() ||
+       pixelDataElement->getUint8Array(pixelData).bad()){
+      cerr << "ERROR: Segmentation dataset does not contain native pixel data!" << endl;
+      return false;
+    }
+    pixelDataLength = pixelDataElement->getLength();
+
+    RLEEncodingJob job;
+    job.pixelData = pixelData;
+    job.pixelDataLength = pixelDataLength;
+    job.frameSize = unsigned(rows)*columns;
+    job.encodedFrames.resize(numberOfFrames);
+    Helper::parallelFor(numberOfFrames, numberOfThreads, &encodeRLEWorkItem, &job);
+
+    DcmPixelSequence *pixelSequence = new DcmPixelSequence(DcmTag(DCM_PixelData, EVR_OB));
+    DcmPixelItem *offsetTable = new DcmPixelItem(DcmTag(DCM_Item, EVR_OB));
+    CHECK_COND(pixelSequence->insert(offsetTable));
+
+    DcmOffsetList offsetList;
+    for(Sint32 frameNumber=0;frameNumber<numberOfFrames;frameNumber++){
+      vector<Uint8> &encodedFrame = job.encodedFrames[frameNumber];
+      CHECK_COND(pixelSequence->storeCompressedFrame(offsetList, &encodedFrame[0], Uint32(encodedFrame.size()), 0));
+      vector<Uint8>().swap(encodedFrame);
+    }
+    CHECK_COND(offsetTable->createOffsetTable(offsetList));
+
+    // replaces the native pixel data
+    OFstatic_cast(DcmPixelData*, pixelDataElement)->putOriginalRepresentation(EXS_RLELossless, NULL, pixelSequence);
+
+    return true;
+  }
+
+  bool ImageSEGConverter::decodeRLE(DcmDataset &segDataset, unsigned numberOfThreads) {
+    Uint16 rows, columns;
+    Sint32 numberOfFrames;
+    DcmElement *pixelDataElement;
+    DcmPixelSequence *pixelSequence = NULL;
+    if(segDataset.findAndGetUint16(DCM_Rows, rows).bad() ||
+       segDataset.findAndGetUint16(DCM_Columns, columns).bad() ||
+       segDataset.findAndGetSint32(DCM_NumberOfFrames, numberOfFrames).bad() ||
+       segDataset.findAndGetElement(DCM_PixelData, pixelDataElement).bad() ||
+       OFstatic_cast(DcmPixelData*, pixelDataElement)->getEncapsulatedRepresentation(EXS_RLELossless, NULL, pixelSequence).bad() ||
+       pixelSequence == NULL){
+      cerr << "ERROR: Segmentation dataset does not contain RLE Lossless pixel data!" << endl;
+      return false;
+    }
+
+    // the offset table is followed by exactly one fragment per frame
+    if(pixelSequence->card() != OFstatic_cast(unsigned long, numberOfFrames)+1){
+      cerr << "ERROR: RLE pixel data has " << pixelSequence->card() << " items, expected " << numberOfFrames+1 << endl;
+      return false;
+    }
+
+    RLEDecodingJob job;
+    job.frameSize = unsigned(rows)*columns;
+    job.encodedFrames.resize(numberOfFrames);
+    job.encodedFrameLengths.resize(numberOfFrames);
+    job.decodedFrames.resize(numberOfFrames);
+    for(Sint32 frameNumber=0;frameNumber<numberOfFrames;frameNumber++){
+      DcmPixelItem *fragment;
+      Uint8 *fragmentData;
+      CHECK_COND(pixelSequence->getItem(fragment, frameNumber+1));
+      CHECK_COND(fragment->getUint8Array(fragmentData));
+      job.encodedFrames[frameNumber] = fragmentData;
+      job.encodedFrameLengths[frameNumber] = fragment->getLength();
+    }
+    Helper::parallelFor(numberOfFrames, numberOfThreads, &decodeRLEWorkItem, &job);
+
+    size_t pixelDataLength;
+    if(!getPackedPixelDataLength(numberOfFrames, job.frameSize, pixelDataLength))
+      return false;
+    const size_t frameBytes = (job.frameSize+7)/8;
+    vector<Uint8> pixelData(pixelDataLength, 0);
+    for(Sint32 frameNumber=0;frameNumber<numberOfFrames;frameNumber++){
+      const vector<Uint8> &decodedFrame = job.decodedFrames[frameNumber];
+      if(decodedFrame.empty()){
+        cerr << "ERROR: Failed to decode RLE frame " << frameNumber+1 << endl;
+        return false;
+      }
+
+      const size_t firstBit = size_t(frameNumber)*job.frameSize;
+      const size_t firstByte = firstBit/8;
+      const unsigned shift = firstBit%8;
+      for(size_t byteNumber=0;byteNumber<frameBytes;byteNumber++){
+        Uint8 value = decodedFrame[byteNumber];
+        // the bits following the last pixel of the frame are padding
+        if(byteNumber == frameBytes-1 && job.frameSize%8)
+          value &= Uint8((1 << (job.frameSize%8))-1);
+        pixelData[firstByte+byteNumber] |= Uint8(value << shift);
+        if(shift && firstByte+byteNumber+1 < pixelData.size())
+          pixelData[firstByte+byteNumber+1] |= Uint8(value >> (8-shift));
+      }
+    }
+
+    // replaces the encapsulated pixel data
+    CHECK_COND(pixelDataElement->putUint8Array(&pixelData[0], pixelData.size()));
+    segDataset.updateOriginalXfer();
+
+    return true;
+  }
+
+  bool ImageSEGConverter::createSegmentation(vector<DcmDataset*> dcmDatasets,
+                                             vector<ShortImageType::Pointer> segmentations,
+                                             const string &metaData,
+                                             DcmDataset &segdocDataset,
+                                             bool skipEmptySlices,
+                                             vector<FrameEncodingItem> &frames) {
 
     ShortImageType::SizeType inputSize = segmentations[0]->GetBufferedRegion().GetSize();
     cout << "Input image size: " << inputSize << endl;
@@ -18,7 +275,7 @@ namespace dcmqi {
 
     if(metaInfo.segmentsAttributesMappingList.size() != segmentations.size()){
       cerr << "Mismatch between the number of input segmentation files and the size of metainfo list!" << endl;
-      return NULL;
+      return false;
     };
 
     IODGeneralEquipmentModule::EquipmentInfo eq = getEquipmentInfo();
@@ -26,13 +283,13 @@ namespace dcmqi {
     CHECK_COND(ident.setInstanceNumber(metaInfo.getInstanceNumber().c_str()));
 
     /* Create new segmentation document */
-    DcmDataset segdocDataset;
     DcmSegmentation *segdoc = NULL;
 
+    // the document only holds 1x1 placeholder frames, the pixel data is encoded by the caller
     DcmSegmentation::createBinarySegmentation(
         segdoc,   // resulting segmentation
-        inputSize[1],    // rows
-        inputSize[0],    // columns
+        1,    // rows
+        1,    // columns
         eq,     // equipment
         ident);   // content identification
 
@@ -91,7 +348,7 @@ namespace dcmqi {
     // Iterate over the files and labels available in each file, create a segment for each label,
     //  initialize segment frames and add to the document
 
-    OFString seriesInstanceUID, classUID;
+    OFString seriesInstanceUID;
     set<OFString> instanceUIDs;
 
     IODCommonInstanceReferenceModule &commref = segdoc->getCommonInstanceReference();
@@ -105,105 +362,98 @@ namespace dcmqi {
     CHECK_COND(refseriesItem->setSeriesInstanceUID(seriesInstanceUID));
 
     int uidfound = 0, uidnotfound = 0;
-    Uint8 *frameData = new Uint8[frameSize];
+
+    Uint8 placeholderFrame = 0;
 
     // NB this assumes all segmentation files have the same dimensions; alternatively, need to
     //   do this operation for each segmentation file
-    vector<vector<int> > slice2derimg = getSliceMapForSegmentation2DerivationImage(dcmDatasets, segmentations[0]);
+    vector<vector<int> > slice2derimg = getSliceMapForSegmentation2DerivationImage<ShortImageType>(dcmDatasets, segmentations[0]);
 
+    // derivation image FG and the referenced source instance are the same for all frames at a given
+    //  slice, so they are built once per slice and shared by the frames of all segments
+    vector<FGDerivationImage*> slice2fgder(slice2derimg.size(), (FGDerivationImage*) NULL);
+    vector<OFString> slice2classUID(slice2derimg.size()), slice2instanceUID(slice2derimg.size());
     bool hasDerivationImages = false;
-    for(vector<vector<int> >::const_iterator vI=slice2derimg.begin();vI!=slice2derimg.end();++vI)
-      if((*vI).size()>0)
-        hasDerivationImages = true;
+    for(size_t sliceNumber=0;sliceNumber<slice2derimg.size();sliceNumber++){
+      if(slice2derimg[sliceNumber].size() == 0)
+        continue;
+      hasDerivationImages = true;
+
+      OFVector<DcmDataset*> siVector;
+      for(size_t derImageInstanceNum=0;
+          derImageInstanceNum<slice2derimg[sliceNumber].size();
+          derImageInstanceNum++){
+        siVector.push_back(dcmDatasets[slice2derimg[sliceNumber][derImageInstanceNum]]);
+      }
+
+      FGDerivationImage* fgder = new FGDerivationImage();
+      slice2fgder[sliceNumber] = fgder;
 
+      DerivationImageItem *derimgItem;
+      CHECK_COND(fgder->addDerivationImageItem(CodeSequenceMacro("113076","DCM","Segmentation"),"",derimgItem));
+
+      cout << "Total of " << siVector.size() << " source image items will be added for slice " << sliceNumber << endl;
+
+      OFVector<SourceImageItem*> srcimgItems;
+      CHECK_COND(derimgItem->addSourceImageItems(siVector,
+                                               CodeSequenceMacro("121322","DCM","Source image for image processing operation"),
+                                               srcimgItems));
+
+      ImageSOPInstanceReferenceMacro &instRef = srcimgItems[0]->getImageSOPInstanceReference();
+      CHECK_COND(instRef.getReferencedSOPClassUID(slice2classUID[sliceNumber]));
+      CHECK_COND(instRef.getReferencedSOPInstanceUID(slice2instanceUID[sliceNumber]));
+    }
 
     FGPlanePosPatient* fgppp = FGPlanePosPatient::createMinimal("1","1","1");
     FGFrameContent* fgfc = new FGFrameContent();
-    FGDerivationImage* fgder = new FGDerivationImage();
+    // used for the frames at slices that have no source images
+    FGDerivationImage* emptyFgder = new FGDerivationImage();
     OFVector<FGBase*> perFrameFGs;
 
     perFrameFGs.push_back(fgppp);
     perFrameFGs.push_back(fgfc);
     if(hasDerivationImages)
-      perFrameFGs.push_back(fgder);
+      perFrameFGs.push_back(emptyFgder);
 
     for(size_t segFileNumber=0; segFileNumber<segmentations.size(); segFileNumber++){
 
       cout << "Processing input label " << segmentations[segFileNumber] << endl;
 
-      LabelToLabelMapFilterType::Pointer l2lm = LabelToLabelMapFilterType::New();
-      l2lm->SetInput(segmentations[segFileNumber]);
-      l2lm->Update();
-
-      typedef LabelToLabelMapFilterType::OutputImageType::LabelObjectType LabelType;
-      typedef itk::LabelStatisticsImageFilter<ShortImageType,ShortImageType> LabelStatisticsType;
-
-      LabelStatisticsType::Pointer labelStats = LabelStatisticsType::New();
-
-      cout << "Found " << l2lm->GetOutput()->GetNumberOfLabelObjects() << " label(s)" << endl;
-      labelStats->SetInput(segmentations[segFileNumber]);
-      labelStats->SetLabelInput(segmentations[segFileNumber]);
-      labelStats->Update();
-
-      bool cropSegmentsBBox = false;
-      if(cropSegmentsBBox){
-        cout << "WARNING: Crop operation enabled - WIP" << endl;
-        typedef itk::BinaryThresholdImageFilter<ShortImageType,ShortImageType> ThresholdType;
-        ThresholdType::Pointer thresh = ThresholdType::New();
-        thresh->SetInput(segmentations[segFileNumber]);
-        thresh->SetLowerThreshold(1);
-        thresh->SetLowerThreshold(100);
-        thresh->SetInsideValue(1);
-        thresh->Update();
-
-        LabelStatisticsType::Pointer threshLabelStats = LabelStatisticsType::New();
-
-        threshLabelStats->SetInput(thresh->GetOutput());
-        threshLabelStats->SetLabelInput(thresh->GetOutput());
-        threshLabelStats->Update();
-
-        LabelStatisticsType::BoundingBoxType threshBbox = threshLabelStats->GetBoundingBox(1);
-        /*
-        cout << "OVerall bounding box: " << threshBbox[0] << ", " << threshBbox[1]
-               << threshBbox[2] << ", " << threshBbox[3]
-               << threshBbox[4] << ", " << threshBbox[5]
-               << endl;
-               */
-        return NULL;
-      }
+      LabelIndexType labelIndex = indexLabels(segmentations[segFileNumber]);
 
-      for(unsigned segLabelNumber=0 ; segLabelNumber<l2lm->GetOutput()->GetNumberOfLabelObjects();segLabelNumber++){
-        LabelType* labelObject = l2lm->GetOutput()->GetNthLabelObject(segLabelNumber);
-        short label = labelObject->GetLabel();
+      cout << "Found " << labelIndex.size() << " label(s)" << endl;
 
-        if(!label){
-          cout << "Skipping label 0" << endl;
-          continue;
-        }
+      // frames of all labels of this file, in the order they are added to the document
+      const size_t firstFileFrame = frames.size();
+
+      for(LabelIndexType::const_iterator labelIt=labelIndex.begin();labelIt!=labelIndex.end();++labelIt){
+        short label = labelIt->first;
+        const LabelExtent &labelExtent = labelIt->second;
 
         cout << "Processing label " << label << endl;
 
-        LabelStatisticsType::BoundingBoxType bbox = labelStats->GetBoundingBox(label);
-        unsigned firstSlice, lastSlice;
-        //bool skipEmptySlices = true; // TODO: what to do with that line?
-        //bool skipEmptySlices = false; // TODO: what to do with that line?
+        // slices to be encoded for this label
+        vector<unsigned> labelSlices;
         if(skipEmptySlices){
-          firstSlice = bbox[4];
-          lastSlice = bbox[5]+1;
+          labelSlices = labelExtent.nonEmptySlices;
         } else {
-          firstSlice = 0;
-          lastSlice = inputSize[2];
+          for(unsigned sliceNumber=0;sliceNumber<inputSize[2];sliceNumber++)
+            labelSlices.push_back(sliceNumber);
         }
 
+        // position index is counted from the first encoded slice; with empty slices skipped
+        //  it may have gaps, but it always corresponds to the position of the frame in the volume
+        unsigned firstSlice = labelSlices[0];
+
         cout << "Total non-empty slices that will be encoded in SEG for label " <<
-        label << " is " << lastSlice-firstSlice << endl <<
+        label << " is " << labelSlices.size() << endl <<
         " (inclusive from " << firstSlice << " to " <<
-        lastSlice << ")" << endl;
+        labelSlices.back() << ")" << endl;
 
         DcmSegment* segment = NULL;
         if(metaInfo.segmentsAttributesMappingList[segFileNumber].find(label) == metaInfo.segmentsAttributesMappingList[segFileNumber].end()){
           cerr << "ERROR: Failed to match label from image to the segment metadata!" << endl;
-          return NULL;
+          return false;
         }
 
         SegmentAttributes* segmentAttributes = metaInfo.segmentsAttributesMappingList[segFileNumber][label];
@@ -222,7 +472,7 @@ namespace dcmqi {
           algoName = segmentAttributes->getSegmentAlgorithmName();
           if(algoName == ""){
             cerr << "ERROR: Algorithm name must be specified for non-manual algorithm types!" << endl;
-            return NULL;
+            return false;
           }
         }
 
@@ -266,122 +516,65 @@ namespace dcmqi {
         Uint16 segmentNumber;
         CHECK_COND(segdoc->addSegment(segment, segmentNumber /* returns logical segment number */));
 
-        // TODO: make it possible to skip empty frames (optional)
-        // iterate over slices for an individual label and populate output frames
-        for(unsigned sliceNumber=firstSlice;sliceNumber<lastSlice;sliceNumber++){
-
-          // PerFrame FG: FrameContentSequence
-          //fracon->setStackID("1"); // all frames go into the same stack
-          CHECK_COND(fgfc->setDimensionIndexValues(segmentNumber, 0));
-          CHECK_COND(fgfc->setDimensionIndexValues(sliceNumber-firstSlice+1, 1));
-          //ostringstream inStackPosSStream; // StackID is not present/needed
-          //inStackPosSStream << s+1;
-          //fracon->setInStackPositionNumber(s+1);
-
-          // PerFrame FG: PlanePositionSequence
-          {
-            ShortImageType::PointType sliceOriginPoint;
-            ShortImageType::IndexType sliceOriginIndex;
-            sliceOriginIndex.Fill(0);
-            sliceOriginIndex[2] = sliceNumber;
-            segmentations[segFileNumber]->TransformIndexToPhysicalPoint(sliceOriginIndex, sliceOriginPoint);
-            ostringstream pppSStream;
-            if(sliceNumber>0){
-              ShortImageType::PointType prevOrigin;
-              ShortImageType::IndexType prevIndex;
-              prevIndex.Fill(0);
-              prevIndex[2] = sliceNumber-1;
-              segmentations[segFileNumber]->TransformIndexToPhysicalPoint(prevIndex, prevOrigin);
-            }
-            fgppp->setImagePositionPatient(
-                Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
-                Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
-                Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
-          }
-
-          /* Add frame that references this segment */
-          {
-            ShortImageType::RegionType sliceRegion;
-            ShortImageType::IndexType sliceIndex;
-            ShortImageType::SizeType sliceSize;
-
-            sliceIndex[0] = 0;
-            sliceIndex[1] = 0;
-            sliceIndex[2] = sliceNumber;
-
-            sliceSize[0] = inputSize[0];
-            sliceSize[1] = inputSize[1];
-            sliceSize[2] = 1;
-
-            sliceRegion.SetIndex(sliceIndex);
-            sliceRegion.SetSize(sliceSize);
-
-            unsigned framePixelCnt = 0;
-            itk::ImageRegionConstIteratorWithIndex<ShortImageType> sliceIterator(segmentations[segFileNumber], sliceRegion);
-            for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd();++sliceIterator,++framePixelCnt){
-              if(sliceIterator.Get() == label){
-                frameData[framePixelCnt] = 1;
-                ShortImageType::IndexType idx = sliceIterator.GetIndex();
-                //cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
-              } else
-                frameData[framePixelCnt] = 0;
-            }
-
-            /*
-            if(sliceNumber>=dcmDatasets.size()){
-              cerr << "ERROR: trying to access missing DICOM Slice! And sorry, multi-frame not supported at the moment..." << endl;
-              return NULL;
-            }*/
-
-            OFVector<DcmDataset*> siVector;
-            for(size_t derImageInstanceNum=0;
-                derImageInstanceNum<slice2derimg[sliceNumber].size();
-                derImageInstanceNum++){
-              siVector.push_back(dcmDatasets[slice2derimg[sliceNumber][derImageInstanceNum]]);
-            }
-
-            if(siVector.size()>0){
-
-              DerivationImageItem *derimgItem;
-              CHECK_COND(fgder->addDerivationImageItem(CodeSequenceMacro("113076","DCM","Segmentation"),"",derimgItem));
-
-              cout << "Total of " << siVector.size() << " source image items will be added" << endl;
-
-              OFVector<SourceImageItem*> srcimgItems;
-              CHECK_COND(derimgItem->addSourceImageItems(siVector,
-                                                       CodeSequenceMacro("121322","DCM","Source image for image processing operation"),
-                                                       srcimgItems));
-
-              if(1){
-                // initialize class UID and series instance UID
-                ImageSOPInstanceReferenceMacro &instRef = srcimgItems[0]->getImageSOPInstanceReference();
-                OFString instanceUID;
-                CHECK_COND(instRef.getReferencedSOPClassUID(classUID));
-                CHECK_COND(instRef.getReferencedSOPInstanceUID(instanceUID));
-
-                if(instanceUIDs.find(instanceUID) == instanceUIDs.end()){
-                  SOPInstanceReferenceMacro *refinstancesItem = new SOPInstanceReferenceMacro();
-                  CHECK_COND(refinstancesItem->setReferencedSOPClassUID(classUID));
-                  CHECK_COND(refinstancesItem->setReferencedSOPInstanceUID(instanceUID));
-                  refinstances.push_back(refinstancesItem);
-                  instanceUIDs.insert(instanceUID);
-                  uidnotfound++;
-                } else {
-                  uidfound++;
-                }
-              }
-            }
+        for(vector<unsigned>::const_iterator sliceIt=labelSlices.begin();sliceIt!=labelSlices.end();++sliceIt){
+          FrameEncodingItem frame;
+          frame.label = label;
+          frame.segmentNumber = segmentNumber;
+          frame.sliceNumber = *sliceIt;
+          frame.positionIndex = *sliceIt-firstSlice+1;
+          frame.slicePixels = segmentations[segFileNumber]->GetBufferPointer() + size_t(*sliceIt)*frameSize;
+          frames.push_back(frame);
+        }
+      }
 
-            CHECK_COND(segdoc->addFrame(frameData, segmentNumber, perFrameFGs));
+      // functional groups are added sequentially, in deterministic order
+      for(size_t frameNumber=firstFileFrame;frameNumber<frames.size();frameNumber++){
+        const FrameEncodingItem &frame = frames[frameNumber];
+        unsigned sliceNumber = frame.sliceNumber;
+
+        // PerFrame FG: FrameContentSequence
+        //fracon->setStackID("1"); // all frames go into the same stack
+        CHECK_COND(fgfc->setDimensionIndexValues(frame.segmentNumber, 0));
+        CHECK_COND(fgfc->setDimensionIndexValues(frame.positionIndex, 1));
+        //ostringstream inStackPosSStream; // StackID is not present/needed
+        //inStackPosSStream << s+1;
+        //fracon->setInStackPositionNumber(s+1);
+
+        // PerFrame FG: PlanePositionSequence
+        {
+          ShortImageType::PointType sliceOriginPoint;
+          ShortImageType::IndexType sliceOriginIndex;
+          sliceOriginIndex.Fill(0);
+          sliceOriginIndex[2] = sliceNumber;
+          segmentations[segFileNumber]->TransformIndexToPhysicalPoint(sliceOriginIndex, sliceOriginPoint);
+          fgppp->setImagePositionPatient(
+              Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
+              Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
+              Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
+        }
 
-            // remove derivation image FG from the per-frame FGs, only if applicable!
-            if(siVector.size()>0){
-              // clean up for the next frame
-              fgder->clearData();
+        /* Add frame that references this segment */
+        if(hasDerivationImages){
+          if(slice2fgder[sliceNumber] != NULL){
+            perFrameFGs[2] = slice2fgder[sliceNumber];
+
+            const OFString &instanceUID = slice2instanceUID[sliceNumber];
+            if(instanceUIDs.find(instanceUID) == instanceUIDs.end()){
+              SOPInstanceReferenceMacro *refinstancesItem = new SOPInstanceReferenceMacro();
+              CHECK_COND(refinstancesItem->setReferencedSOPClassUID(slice2classUID[sliceNumber]));
+              CHECK_COND(refinstancesItem->setReferencedSOPInstanceUID(instanceUID));
+              refinstances.push_back(refinstancesItem);
+              instanceUIDs.insert(instanceUID);
+              uidnotfound++;
+            } else {
+              uidfound++;
             }
-
+          } else {
+            perFrameFGs[2] = emptyFgder;
           }
         }
+
+        CHECK_COND(segdoc->addFrame(&placeholderFrame, frame.segmentNumber, perFrameFGs));
       }
     }
 
@@ -391,7 +584,9 @@ namespace dcmqi {
 
     delete fgfc;
     delete fgppp;
-    delete fgder;
+    delete emptyFgder;
+    for(size_t sliceNumber=0;sliceNumber<slice2fgder.size();sliceNumber++)
+      delete slice2fgder[sliceNumber];
 
     segdoc->getSeries().setSeriesNumber(metaInfo.getSeriesNumber().c_str());
 
@@ -405,9 +600,14 @@ namespace dcmqi {
 
     if(segdoc->writeDataset(segdocDataset).bad()){
       cerr << "FATAL ERROR: Writing of the SEG dataset failed! Please report the problem to the developers, ideally accompanied by a de-identified dataset allowing to reproduce the problem!" << endl;
-      return NULL;
+      return false;
     }
 
+    // the placeholder frames are replaced by the caller
+    CHECK_COND(segdocDataset.putAndInsertUint16(DCM_Rows, inputSize[1]));
+    CHECK_COND(segdocDataset.putAndInsertUint16(DCM_Columns, inputSize[0]));
+    CHECK_COND(segdocDataset.findAndDeleteElement(DCM_PixelData));
+
     // Set reader/session/timepoint information
     CHECK_COND(segdocDataset.putAndInsertString(DCM_SeriesDescription, metaInfo.getSeriesDescription().c_str()));
     CHECK_COND(segdocDataset.putAndInsertString(DCM_ContentCreatorName, metaInfo.getContentCreatorName().c_str()));
@@ -444,17 +644,30 @@ namespace dcmqi {
       segdoc->getGeneralImage().setContentTime(contentTime.c_str());
     }
 
-    return new DcmDataset(segdocDataset);
+    delete segdoc;
+
+    return true;
   }
 
 
-  pair <map<unsigned,ShortImageType::Pointer>, string> ImageSEGConverter::dcmSegmentation2itkimage(DcmDataset *segDataset) {
+  pair <map<unsigned,ShortImageType::Pointer>, string> ImageSEGConverter::dcmSegmentation2itkimage(DcmDataset *segDataset,
+                                                                                                    bool mergeSegments,
+                                                                                                    bool cropSegments,
+                                                                                                    const vector<string> &segmentFilter,
+                                                                                                    unsigned numberOfThreads) {
 
     DcmRLEDecoderRegistration::registerCodecs();
 
     OFLogger dcemfinfLogger = OFLog::getLogger("qiicr.apps");
     dcemfinfLogger.setLogLevel(dcmtk::log4cplus::OFF_LOG_LEVEL);
 
+    if(segDataset->getOriginalXfer() == EXS_RLELossless){
+      Uint16 bitsAllocated;
+      if(segDataset->findAndGetUint16(DCM_BitsAllocated, bitsAllocated).good() && bitsAllocated == 1 &&
+         !decodeRLE(*segDataset, numberOfThreads))
+        throw -1;
+    }
+
     DcmSegmentation *segdoc = NULL;
     OFCondition cond = DcmSegmentation::loadDataset(*segDataset, segdoc);
     if(!segdoc){
@@ -462,6 +675,16 @@ namespace dcmqi {
       throw -1;
     }
 
+    // segments to be decoded; all of them if no filter is given
+    set<Uint16> selectedSegments;
+    if(!segmentFilter.empty()){
+      selectedSegments = selectSegments(segdoc, segmentFilter);
+      if(selectedSegments.empty()){
+        cerr << "ERROR: none of the segments matches the segment filter!" << endl;
+        throw -1;
+      }
+    }
+
     // Directions
     FGInterface &fgInterface = segdoc->getFunctionalGroups();
     ShortImageType::DirectionType direction;
@@ -472,13 +695,12 @@ namespace dcmqi {
 
     // Spacing and origin
     double computedSliceSpacing, computedVolumeExtent;
-    vnl_vector<double> sliceDirection(3);
-    sliceDirection[0] = direction[0][2];
-    sliceDirection[1] = direction[1][2];
-    sliceDirection[2] = direction[2][2];
+    FrameGeometryIndex geometryIndex;
+    if(buildGeometryIndex(fgInterface, direction, geometryIndex))
+      throw -1;
 
     ShortImageType::PointType imageOrigin;
-    if(computeVolumeExtent(fgInterface, sliceDirection, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
+    if(computeVolumeExtent(geometryIndex, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
       cerr << "Failed to compute origin and/or slice spacing!" << endl;
       throw -1;
     }
@@ -509,7 +731,8 @@ namespace dcmqi {
     // number of slices should be computed, since segmentation may have empty frames
     imageSize[2] = ceil(computedVolumeExtent/imageSpacing[2])+1;
 
-    // Initialize the image
+    // Initialize the geometry of the volume, used to position the cropped output images; the buffer is not
+    //  allocated, since the pixels are written to the output images
     ShortImageType::RegionType imageRegion;
     imageRegion.SetSize(imageSize);
     ShortImageType::Pointer segImage = ShortImageType::New();
@@ -517,30 +740,24 @@ namespace dcmqi {
     segImage->SetOrigin(imageOrigin);
     segImage->SetSpacing(imageSpacing);
     segImage->SetDirection(direction);
-    segImage->Allocate();
-    segImage->FillBuffer(0);
 
-    // ITK images corresponding to the individual segments
+    // ITK images corresponding to the individual segments, or to the layers of merged segments
     map<unsigned,ShortImageType::Pointer> segment2image;
 
+    // frames to be decoded, in the order of the document
+    vector<SegmentFrameItem> segmentFrames;
+
     // Iterate over frames, find the matching slice for each of the frames based on
     // ImagePositionPatient, set non-zero pixels to the segment number. Notify
     // about pixels that are initialized more than once.
 
-    DcmIODTypes::Frame *unpackedFrame = NULL;
-
     JSONSegmentationMetaInformationHandler metaInfo;
 
     populateMetaInformationFromDICOM(segDataset, segdoc, metaInfo);
 
     for(size_t frameId=0;frameId<fgInterface.getNumberOfFrames();frameId++){
-      const DcmIODTypes::Frame *frame = segdoc->getFrame(frameId);
       bool isPerFrame;
 
-      FGPlanePosPatient *planposfg =
-          OFstatic_cast(FGPlanePosPatient*,fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-      assert(planposfg);
-
 #ifndef NDEBUG
       FGFrameContent *fracon =
           OFstatic_cast(FGFrameContent*,fgInterface.get(frameId, DcmFGTypes::EFG_FRAMECONTENT, isPerFrame));
@@ -564,15 +781,9 @@ namespace dcmqi {
         throw -1;
       }
 
-      if(segment2image.find(segmentId) == segment2image.end()){
-        typedef itk::ImageDuplicator<ShortImageType> DuplicatorType;
-        DuplicatorType::Pointer dup = DuplicatorType::New();
-        dup->SetInputImage(segImage);
-        dup->Update();
-        ShortImageType::Pointer newSegmentImage = dup->GetOutput();
-        newSegmentImage->FillBuffer(0);
-        segment2image[segmentId] = newSegmentImage;
-      }
+      // frames of the segments that were not requested are not decoded
+      if(!selectedSegments.empty() && selectedSegments.find(segmentId) == selectedSegments.end())
+        continue;
 
       // populate meta information needed for Slicer ScalarVolumeNode initialization
       //  (for example)
@@ -654,54 +865,456 @@ namespace dcmqi {
         }
       }
 
-      // get string representation of the frame origin
-      ShortImageType::PointType frameOriginPoint;
-      ShortImageType::IndexType frameOriginIndex;
-      for(int j=0;j<3;j++){
-        OFString planposStr;
-        if(planposfg->getImagePositionPatient(planposStr, j).good()){
-          frameOriginPoint[j] = atof(planposStr.c_str());
+      // find the matching slice based on the position of the frame along the slice direction
+      const unsigned sliceNumber = geometryIndex.getSliceNumber(frameId, imageSpacing[2]);
+      if(sliceNumber >= imageSize[2]){
+        const double *framePosition = geometryIndex.getImagePosition(frameId);
+        cerr << "ERROR: Frame " << frameId << " origin " << framePosition[0] << ", " << framePosition[1] << ", " <<
+        framePosition[2] << " is outside image geometry! Slice " << sliceNumber << endl;
+        cerr << "Image size: " << imageSize << endl;
+        throw -1;
+      }
+
+      SegmentFrameItem segmentFrame;
+      segmentFrame.frameNumber = frameId;
+      segmentFrame.segmentNumber = segmentId;
+      segmentFrame.sliceNumber = sliceNumber;
+      segmentFrames.push_back(segmentFrame);
+    }
+
+    const bool isBinary = segdoc->getSegmentationType() == DcmSegTypes::ST_BINARY;
+
+    // output image of each segment: its own image, or the layer it is merged into
+    map<Uint16,unsigned> segment2output;
+    if(mergeSegments){
+      segment2output = assignSegmentLayers(segdoc, segmentFrames, imageSize[0]*imageSize[1], isBinary);
+
+      // one list of segment attributes per layer
+      vector<map<unsigned,SegmentAttributes*> > layerAttributes;
+      for(size_t i=0;i<metaInfo.segmentsAttributesMappingList.size();i++){
+        const map<unsigned,SegmentAttributes*> &segmentAttributes = metaInfo.segmentsAttributesMappingList[i];
+        for(map<unsigned,SegmentAttributes*>::const_iterator mIt=segmentAttributes.begin();mIt!=segmentAttributes.end();++mIt){
+          unsigned layer = segment2output[mIt->first];
+          if(layerAttributes.size() < layer)
+            layerAttributes.resize(layer);
+          layerAttributes[layer-1][mIt->first] = mIt->second;
         }
       }
+      metaInfo.segmentsAttributesMappingList = layerAttributes;
 
-      if(!segment2image[segmentId]->TransformPhysicalPointToIndex(frameOriginPoint, frameOriginIndex)){
-        cerr << "ERROR: Frame " << frameId << " origin " << frameOriginPoint <<
-        " is outside image geometry!" << frameOriginIndex << endl;
-        cerr << "Image size: " << segment2image[segmentId]->GetBufferedRegion().GetSize() << endl;
-        throw -1;
+      cout << "Merged " << segment2output.size() << " segments into " << layerAttributes.size() << " label image(s)" << endl;
+    } else {
+      for(size_t i=0;i<segmentFrames.size();i++)
+        segment2output[segmentFrames[i].segmentNumber] = segmentFrames[i].segmentNumber;
+    }
+
+    // region of the volume covered by each output image
+    map<unsigned,ShortImageType::RegionType> output2region;
+    if(cropSegments)
+      output2region = getOutputRegions(segdoc, segmentFrames, segment2output, imageSize, isBinary);
+
+    // allocate the output images, and group the frames by the slice of the output image they are written to
+    FrameDecodingJob job;
+    job.columns = imageSize[0];
+    job.isBinary = isBinary;
+    map<pair<unsigned,long>, size_t> destination2item;
+    for(size_t i=0;i<segmentFrames.size();i++){
+      const SegmentFrameItem &segmentFrame = segmentFrames[i];
+      unsigned outputNumber = segment2output[segmentFrame.segmentNumber];
+
+      const ShortImageType::RegionType outputRegion = cropSegments ? output2region[outputNumber] : imageRegion;
+      const ShortImageType::IndexType &outputIndex = outputRegion.GetIndex();
+      const ShortImageType::SizeType &outputSize = outputRegion.GetSize();
+
+      if(segment2image.find(outputNumber) == segment2image.end()){
+        ShortImageType::Pointer newSegmentImage = ShortImageType::New();
+        // cropped images start at the origin of their region, and are indexed from 0
+        ShortImageType::PointType outputOrigin;
+        segImage->TransformIndexToPhysicalPoint(outputIndex, outputOrigin);
+        newSegmentImage->SetRegions(outputSize);
+        newSegmentImage->SetOrigin(outputOrigin);
+        newSegmentImage->SetSpacing(imageSpacing);
+        newSegmentImage->SetDirection(direction);
+        newSegmentImage->Allocate();
+        newSegmentImage->FillBuffer(0);
+        segment2image[outputNumber] = newSegmentImage;
+      }
+
+      const long sliceNumber = segmentFrame.sliceNumber;
+      if(sliceNumber < outputIndex[2] || sliceNumber >= long(outputIndex[2]+outputSize[2]))
+        continue;
+
+      const pair<unsigned,long> destination(outputNumber, sliceNumber);
+      if(destination2item.find(destination) == destination2item.end()){
+        destination2item[destination] = job.items.size();
+        FrameDecodingItem item;
+        item.slicePixels = segment2image[outputNumber]->GetBufferPointer() +
+                           size_t(sliceNumber-outputIndex[2])*outputSize[0]*outputSize[1];
+        item.outputRegion = outputRegion;
+        job.items.push_back(item);
+      }
+      FrameDecodingItem &item = job.items[destination2item[destination]];
+      item.frames.push_back(segdoc->getFrame(segmentFrame.frameNumber));
+      item.segmentNumbers.push_back(segmentFrame.segmentNumber);
+    }
+
+    Helper::parallelFor(job.items.size(), numberOfThreads, &decodeFrameWorkItem, &job);
+
+    return pair <map<unsigned,ShortImageType::Pointer>, string>(segment2image, metaInfo.getJSONOutputAsString());
+  }
+
+  void ImageSEGConverter::decodeFrameWorkItem(size_t itemNumber, void *job) {
+    FrameDecodingJob *decodingJob = static_cast<FrameDecodingJob*>(job);
+    const FrameDecodingItem &item = decodingJob->items[itemNumber];
+    const ShortImageType::IndexType &outputIndex = item.outputRegion.GetIndex();
+    const ShortImageType::SizeType &outputSize = item.outputRegion.GetSize();
+
+    // frames are applied in the order of the document, so that later frames win where they overlap
+    for(size_t i=0;i<item.frames.size();i++){
+      const Uint8 *pixData = item.frames[i]->pixData;
+      const ShortPixelType segmentNumber = item.segmentNumbers[i];
+      for(unsigned row=0;row<outputSize[1];row++){
+        const size_t firstPixel = size_t(outputIndex[1]+row)*decodingJob->columns + outputIndex[0];
+        ShortPixelType *rowPixels = item.slicePixels + size_t(row)*outputSize[0];
+        if(decodingJob->isBinary){
+          unpackBinaryPixels(pixData, firstPixel, outputSize[0], segmentNumber, rowPixels);
+        } else {
+          for(unsigned column=0;column<outputSize[0];column++)
+            if(pixData[firstPixel+column])
+              rowPixels[column] = segmentNumber;
+        }
+      }
+    }
+  }
+
+  set<Uint16> ImageSEGConverter::selectSegments(DcmSegmentation *segdoc, const vector<string> &segmentFilter) {
+    set<Uint16> selectedSegments;
+    for(size_t i=0;i<segmentFilter.size();i++){
+      const string &filterItem = segmentFilter[i];
+      bool matched = false;
+      for(Uint16 segmentNumber=1;segmentNumber<=segdoc->getNumberOfSegments();segmentNumber++){
+        DcmSegment *segment = segdoc->getSegment(segmentNumber);
+        if(!segment)
+          continue;
+
+        stringstream segmentNumberSStream;
+        segmentNumberSStream << segmentNumber;
+        OFString segmentLabel, typeCodeValue;
+        segment->getSegmentLabel(segmentLabel);
+        segment->getSegmentedPropertyTypeCode().getCodeValue(typeCodeValue);
+
+        if(filterItem == segmentNumberSStream.str() || filterItem == segmentLabel.c_str() ||
+           filterItem == typeCodeValue.c_str()){
+          selectedSegments.insert(segmentNumber);
+          matched = true;
+        }
+      }
+      if(!matched)
+        cerr << "WARNING: no segment matches " << filterItem << endl;
+    }
+    return selectedSegments;
+  }
+
+  map<Uint16,unsigned> ImageSEGConverter::assignSegmentLayers(DcmSegmentation *segdoc,
+                                                             const vector<SegmentFrameItem> &segmentFrames,
+                                                             size_t frameSize, bool isBinary) {
+    // frames of each segment, segments in the order of their numbers
+    map<Uint16, vector<size_t> > segment2frames;
+    for(size_t i=0;i<segmentFrames.size();i++)
+      segment2frames[segmentFrames[i].segmentNumber].push_back(i);
+
+    // for each layer, the frames already placed at each slice
+    vector<map<unsigned, vector<size_t> > > layerSliceFrames;
+    map<Uint16,unsigned> segment2layer;
+
+    // each segment goes to the first layer where it does not overlap with any of the segments placed before it
+    for(map<Uint16, vector<size_t> >::const_iterator sIt=segment2frames.begin();sIt!=segment2frames.end();++sIt){
+      const vector<size_t> &frames = sIt->second;
+      size_t layer = 0;
+      for(;layer<layerSliceFrames.size();layer++){
+        bool overlaps = false;
+        for(size_t i=0;i<frames.size() && !overlaps;i++){
+          const SegmentFrameItem &segmentFrame = segmentFrames[frames[i]];
+          map<unsigned, vector<size_t> >::const_iterator lIt = layerSliceFrames[layer].find(segmentFrame.sliceNumber);
+          if(lIt == layerSliceFrames[layer].end())
+            continue;
+          for(size_t j=0;j<lIt->second.size() && !overlaps;j++)
+            overlaps = framesOverlap(segdoc->getFrame(segmentFrame.frameNumber),
+                                     segdoc->getFrame(segmentFrames[lIt->second[j]].frameNumber),
+                                     frameSize, isBinary);
+        }
+        if(!overlaps)
+          break;
+      }
+
+      if(layer == layerSliceFrames.size())
+        layerSliceFrames.push_back(map<unsigned, vector<size_t> >());
+      for(size_t i=0;i<frames.size();i++)
+        layerSliceFrames[layer][segmentFrames[frames[i]].sliceNumber].push_back(frames[i]);
+      segment2layer[sIt->first] = unsigned(layer+1);
+    }
+
+    return segment2layer;
+  }
+
+  bool ImageSEGConverter::framesOverlap(const DcmIODTypes::Frame *frame1, const DcmIODTypes::Frame *frame2,
+                                        size_t frameSize, bool isBinary) {
+    const size_t length = min(min(frame1->length, frame2->length), isBinary ? (frameSize+7)/8 : frameSize);
+    // binary frames are compared directly in the packed form
+    if(isBinary){
+      for(size_t i=0;i<length;i++){
+        Uint8 overlap = frame1->pixData[i] & frame2->pixData[i];
+        // only the low bits of the last byte belong to the frame, the others are padding
+        if(i == frameSize/8)
+          overlap &= Uint8((1 << (frameSize%8)) - 1);
+        if(overlap)
+          return true;
+      }
+    } else {
+      for(size_t i=0;i<length;i++)
+        if(frame1->pixData[i] && frame2->pixData[i])
+          return true;
+    }
+    return false;
+  }
+
+  void ImageSEGConverter::encodeFrameWorkItem(size_t groupNumber, void *job) {
+    FrameEncodingJob *encodingJob = static_cast<FrameEncodingJob*>(job);
+    const unsigned frameSize = encodingJob->frameSize;
+    const size_t firstFrame = groupNumber*8;
+    const size_t endFrame = min(encodingJob->numberOfFrames, firstFrame+8);
+
+    // 8 frames take exactly frameSize bytes, so the groups do not share any byte of the packed data
+    Uint8 *groupData = encodingJob->packedData + groupNumber*frameSize;
+    for(size_t frameNumber=firstFrame;frameNumber<endFrame;frameNumber++){
+      const FrameEncodingItem &frame = encodingJob->frames[frameNumber];
+      packBinaryPixels(frame.slicePixels, frame.label, frameSize, unsigned(frameNumber-firstFrame)*frameSize, groupData);
+    }
+  }
+
+  void ImageSEGConverter::encodeRLEWorkItem(size_t frameNumber, void *job) {
+    RLEEncodingJob *encodingJob = static_cast<RLEEncodingJob*>(job);
+    const unsigned frameSize = encodingJob->frameSize;
+
+    // native frames are not padded, so a frame may start in the middle of a byte
+    const size_t firstBit = frameNumber*frameSize;
+    const size_t firstByte = firstBit/8;
+    const unsigned shift = firstBit%8;
+    const size_t frameBytes = (frameSize+7)/8;
+
+    DcmRLEEncoder rleEncoder(1 /* pad to even length */);
+    for(size_t byteNumber=0;byteNumber<frameBytes;byteNumber++){
+      const size_t sourceByte = firstByte+byteNumber;
+      Uint8 value = Uint8(encodingJob->pixelData[sourceByte] >> shift);
+      if(shift && sourceByte+1<encodingJob->pixelDataLength)
+        value |= Uint8(encodingJob->pixelData[sourceByte+1] << (8-shift));
+      // clear the bits following the last pixel of the frame
+      if(byteNumber == frameBytes-1 && frameSize%8)
+        value &= Uint8((1 << (frameSize%8))-1);
+      rleEncoder.add(value);
+    }
+    rleEncoder.flush();
+
+    // RLE header: a single segment, starting right after the 64 byte header
+    vector<Uint8> &encodedFrame = encodingJob->encodedFrames[frameNumber];
+    encodedFrame.assign(64+rleEncoder.size(), 0);
+    encodedFrame[0] = 1;
+    encodedFrame[4] = 64;
+    rleEncoder.write(&encodedFrame[64]);
+  }
+
+  void ImageSEGConverter::decodeRLEWorkItem(size_t frameNumber, void *job) {
+    RLEDecodingJob *decodingJob = static_cast<RLEDecodingJob*>(job);
+    const Uint8 *encodedFrame = decodingJob->encodedFrames[frameNumber];
+    const size_t encodedLength = decodingJob->encodedFrameLengths[frameNumber];
+    const size_t frameBytes = (decodingJob->frameSize+7)/8;
+    vector<Uint8> &decodedFrame = decodingJob->decodedFrames[frameNumber];
+
+    // RLE header: the number of segments, which is 1 for 1-bit data, followed by the offset of each segment
+    if(encodedLength < 64 || encodedFrame[0] != 1 || encodedFrame[1] || encodedFrame[2] || encodedFrame[3])
+      return;
+    size_t position = size_t(encodedFrame[4]) | (size_t(encodedFrame[5]) << 8) |
+                      (size_t(encodedFrame[6]) << 16) | (size_t(encodedFrame[7]) << 24);
+
+    // PackBits: n >= 0 is followed by n+1 literal bytes, -127 <= n <= -1 by a byte repeated 1-n times
+    decodedFrame.reserve(frameBytes+128);
+    while(position < encodedLength && decodedFrame.size() < frameBytes){
+      const int control = Sint8(encodedFrame[position++]);
+      if(control >= 0){
+        if(position+control+1 > encodedLength)
+          break;
+        decodedFrame.insert(decodedFrame.end(), encodedFrame+position, encodedFrame+position+control+1);
+        position += control+1;
+      } else if(control != -128){
+        if(position >= encodedLength)
+          break;
+        decodedFrame.insert(decodedFrame.end(), size_t(1-control), encodedFrame[position++]);
       }
+    }
+
+    // the segment may be padded to even length
+    if(decodedFrame.size() < frameBytes)
+      decodedFrame.clear();
+    else
+      decodedFrame.resize(frameBytes);
+  }
+
+  void ImageSEGConverter::unpackBinaryPixels(const Uint8 *packedFrame, const size_t firstBit, const unsigned numberOfPixels,
+                                             const ShortPixelType value, ShortPixelType *pixels) {
+    size_t bit = firstBit;
+    unsigned pixelNumber = 0;
+
+    // up to the first byte boundary
+    for(;bit%8 && pixelNumber<numberOfPixels;bit++,pixelNumber++)
+      if(packedFrame[bit/8] & (1 << (bit%8)))
+        pixels[pixelNumber] = value;
+
+    // whole bytes; segmentations are mostly empty, so whole bytes of background are skipped
+    for(;pixelNumber+8<=numberOfPixels;pixelNumber+=8,bit+=8){
+      Uint8 bits = packedFrame[bit/8];
+      for(unsigned bitNumber=0;bits;bitNumber++,bits>>=1)
+        if(bits & 1)
+          pixels[pixelNumber+bitNumber] = value;
+    }
+
+    // remaining pixels of an incomplete last byte
+    for(;pixelNumber<numberOfPixels;bit++,pixelNumber++)
+      if(packedFrame[bit/8] & (1 << (bit%8)))
+        pixels[pixelNumber] = value;
+  }
 
-      unsigned slice = frameOriginIndex[2];
-
-      if(segdoc->getSegmentationType() == DcmSegTypes::ST_BINARY)
-        unpackedFrame = DcmSegUtils::unpackBinaryFrame(frame,
-                                 imageSize[1], // Rows
-                                 imageSize[0]); // Cols
-      else
-        unpackedFrame = new DcmIODTypes::Frame(*frame);
-
-      // initialize slice with the frame content
-      for(unsigned row=0;row<imageSize[1];row++){
-        for(unsigned col=0;col<imageSize[0];col++){
-          ShortImageType::PixelType pixel;
-          unsigned bitCnt = row*imageSize[0]+col;
-          pixel = unpackedFrame->pixData[bitCnt];
-
-          if(pixel!=0){
-            ShortImageType::IndexType index;
-            index[0] = col;
-            index[1] = row;
-            index[2] = slice;
-            segment2image[segmentId]->SetPixel(index, segmentId);
+  map<unsigned,ShortImageType::RegionType> ImageSEGConverter::getOutputRegions(DcmSegmentation *segdoc,
+                                                                               const vector<SegmentFrameItem> &segmentFrames,
+                                                                               map<Uint16,unsigned> &segment2output,
+                                                                               const ShortImageType::SizeType &imageSize,
+                                                                               bool isBinary) {
+    // inclusive bounding box of each output image, ordered as xmin, xmax, ymin, ymax, zmin, zmax
+    map<unsigned, vector<unsigned> > output2bbox;
+    const unsigned frameSize = imageSize[0]*imageSize[1];
+
+    for(size_t i=0;i<segmentFrames.size();i++){
+      const SegmentFrameItem &segmentFrame = segmentFrames[i];
+      const DcmIODTypes::Frame *frame = segdoc->getFrame(segmentFrame.frameNumber);
+      vector<unsigned> &bbox = output2bbox[segment2output[segmentFrame.segmentNumber]];
+
+      for(unsigned pixelNumber=0;pixelNumber<frameSize;pixelNumber++){
+        bool isSet;
+        if(isBinary){
+          // skip whole bytes of background
+          if(pixelNumber%8 == 0 && !frame->pixData[pixelNumber/8]){
+            pixelNumber += 7;
+            continue;
           }
+          isSet = (frame->pixData[pixelNumber/8] & (1 << (pixelNumber%8))) != 0;
+        } else {
+          isSet = frame->pixData[pixelNumber] != 0;
+        }
+        if(!isSet)
+          continue;
+
+        unsigned x = pixelNumber % imageSize[0], y = pixelNumber / imageSize[0], z = segmentFrame.sliceNumber;
+        if(bbox.empty()){
+          unsigned initialBBox[6] = {x, x, y, y, z, z};
+          bbox.assign(initialBBox, initialBBox+6);
+        } else {
+          bbox[0] = min(bbox[0], x); bbox[1] = max(bbox[1], x);
+          bbox[2] = min(bbox[2], y); bbox[3] = max(bbox[3], y);
+          bbox[4] = min(bbox[4], z); bbox[5] = max(bbox[5], z);
         }
       }
+    }
 
-      if(unpackedFrame != NULL)
-        delete unpackedFrame;
+    map<unsigned,ShortImageType::RegionType> output2region;
+    for(map<unsigned, vector<unsigned> >::const_iterator bIt=output2bbox.begin();bIt!=output2bbox.end();++bIt){
+      ShortImageType::IndexType regionIndex;
+      ShortImageType::SizeType regionSize;
+      if(bIt->second.empty()){
+        // segment without any pixels set
+        regionIndex.Fill(0);
+        regionSize.Fill(1);
+      } else {
+        for(unsigned d=0;d<3;d++){
+          regionIndex[d] = bIt->second[2*d];
+          regionSize[d] = bIt->second[2*d+1]-bIt->second[2*d]+1;
+        }
+      }
+      output2region[bIt->first] = ShortImageType::RegionType(regionIndex, regionSize);
     }
+    return output2region;
+  }
 
-    return pair <map<unsigned,ShortImageType::Pointer>, string>(segment2image, metaInfo.getJSONOutputAsString());
+  void ImageSEGConverter::packBinaryPixels(const ShortPixelType *pixels, const ShortPixelType label,
+                                           const size_t numberOfPixels, const unsigned firstBit, Uint8 *packedData) {
+    Uint8 *packedByte = packedData + firstBit/8;
+    unsigned bit = firstBit%8;
+    size_t pixelNumber = 0;
+
+    // up to the first byte boundary
+    if(bit){
+      for(;bit<8 && pixelNumber<numberOfPixels;bit++,pixelNumber++)
+        *packedByte |= Uint8((pixels[pixelNumber] == label) << bit);
+      if(bit == 8)
+        packedByte++;
+    }
+
+    // whole bytes, each built from the label comparisons of 8 pixels
+    itk::uint64_t labels = Uint16(label);
+    labels |= labels << 16;
+    labels |= labels << 32;
+    for(;pixelNumber+8<=numberOfPixels;pixelNumber+=8,packedByte++)
+      *packedByte = Uint8(matchLabelBits(pixels+pixelNumber, labels) |
+                          (matchLabelBits(pixels+pixelNumber+4, labels) << 4));
+
+    // remaining pixels of an incomplete last byte
+    for(bit=0;pixelNumber<numberOfPixels;bit++,pixelNumber++)
+      *packedByte |= Uint8((pixels[pixelNumber] == label) << bit);
+  }
+
+  ImageSEGConverter::LabelIndexType ImageSEGConverter::indexLabels(const ShortImageType::Pointer &labelImage) {
+    LabelIndexType labelIndex;
+
+    ShortImageType::SizeType size = labelImage->GetBufferedRegion().GetSize();
+    const ShortPixelType *pixel = labelImage->GetBufferPointer();
+
+    // lookup table from the label value to its entry in labelIndex, so that the map
+    //  is only searched when a label value is encountered for the first time
+    const int valueOffset = -itk::NumericTraits<ShortPixelType>::min();
+    vector<LabelExtent*> value2extent(itk::NumericTraits<ShortPixelType>::max()+valueOffset+1, (LabelExtent*) NULL);
+
+    for(unsigned z=0;z<size[2];z++){
+      for(unsigned y=0;y<size[1];y++){
+        for(unsigned x=0;x<size[0];x++,pixel++){
+          if(!*pixel)
+            continue;
+
+          LabelExtent* &extent = value2extent[*pixel+valueOffset];
+          if(extent == NULL){
+            extent = &labelIndex[*pixel];
+            extent->bbox[0] = extent->bbox[1] = x;
+            extent->bbox[2] = extent->bbox[3] = y;
+            extent->bbox[4] = extent->bbox[5] = z;
+            extent->nonEmptySlices.push_back(z);
+            continue;
+          }
+
+          if(x<extent->bbox[0])
+            extent->bbox[0] = x;
+          if(x>extent->bbox[1])
+            extent->bbox[1] = x;
+          if(y<extent->bbox[2])
+            extent->bbox[2] = y;
+          if(y>extent->bbox[3])
+            extent->bbox[3] = y;
+          // slices are visited in increasing order
+          if(extent->nonEmptySlices.back() != z){
+            extent->bbox[5] = z;
+            extent->nonEmptySlices.push_back(z);
+          }
+        }
+      }
+    }
+
+    return labelIndex;
   }
 
   void ImageSEGConverter::populateMetaInformationFromDICOM(DcmDataset *segDataset, DcmSegmentation *segdoc,
@@ -93,10 +93,11 @@ namespace dcmqi {
   }
 
   Json::Value JSONSegmentationMetaInformationHandler::createAndGetSegmentAttributes() {
-    // return a list of lists, where each inner list contains just one item (segment)
+    // return a list of lists, where each inner list contains the segments of one label image
     Json::Value values(Json::arrayValue);
     for (vector<map<unsigned,SegmentAttributes*> >::const_iterator vIt = this->segmentsAttributesMappingList.begin();
        vIt != this->segmentsAttributesMappingList.end(); ++vIt) {
+      Json::Value innerList(Json::arrayValue);
       for(map<unsigned,SegmentAttributes*>::const_iterator mIt=vIt->begin();mIt!=vIt->end();++mIt){
         Json::Value segment;
         SegmentAttributes* segmentAttributes = mIt->second;
@@ -130,10 +131,9 @@ namespace dcmqi {
         rgb.append(segmentAttributes->getRecommendedDisplayRGBValue()[1]);
         rgb.append(segmentAttributes->getRecommendedDisplayRGBValue()[2]);
         segment["recommendedDisplayRGBValue"] = rgb;
-        Json::Value innerList(Json::arrayValue);
         innerList.append(segment);
-        values.append(innerList);
       }
+      values.append(innerList);
     }
     return values;
   }
@@ -1,7 +1,11 @@
 
+// STD includes
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 // ITK includes
 #include <itkImageDuplicator.h>
-#include <itkCastImageFilter.h>
 
 // DCMQI includes
 #include "dcmqi/ParaMapConverter.h"
@@ -11,19 +15,107 @@ using namespace std;
 
 namespace dcmqi {
 
-  DcmDataset* ParaMapConverter::itkimage2paramap(const FloatImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
-                                         const string &metaData) {
+  // pixel values of a slice in the stored pixel type; the slice is used as is if the types are the same, and
+  //  is otherwise converted into buffer as round((value-intercept)/slope), clamped to the range of the type
+  template <class PixelType, class StoredPixelType>
+  struct StoredPixels {
+    static StoredPixelType* get(PixelType *slice, size_t numberOfPixels, vector<StoredPixelType> &buffer,
+                                double slope, double intercept) {
+      buffer.resize(numberOfPixels);
+      const double minStored = numeric_limits<StoredPixelType>::is_integer ? double(numeric_limits<StoredPixelType>::min()) :
+                                                                              -double(numeric_limits<StoredPixelType>::max());
+      const double maxStored = double(numeric_limits<StoredPixelType>::max());
+      for(size_t pixelPosition=0;pixelPosition<numberOfPixels;pixelPosition++){
+        double value = (slice[pixelPosition]-intercept)/slope;
+        if(numeric_limits<StoredPixelType>::is_integer)
+          value = floor(value+0.5);
+        buffer[pixelPosition] = StoredPixelType(max(minStored, min(maxStored, value)));
+      }
+      return &buffer[0];
+    }
+  };
+
+  template <class PixelType>
+  struct StoredPixels<PixelType,PixelType> {
+    static PixelType* get(PixelType *slice, size_t, vector<PixelType>&, double, double) {
+      return slice;
+    }
+  };
+
+  // slope and intercept mapping the stored values of an integer pixel type to the input values; the values are
+  //  stored as they are if they are all integers within the range of the type, and are otherwise scaled to the
+  //  full range of the type
+  template <class ImageType, class StoredPixelType>
+  static void getStoredValueMapping(const vector<typename ImageType::Pointer> &volumes, double &slope, double &intercept) {
+    const double minStored = double(numeric_limits<StoredPixelType>::min());
+    const double maxStored = double(numeric_limits<StoredPixelType>::max());
+    double minValue = 0, maxValue = 0;
+    bool isIntegral = true;
+    for(size_t volumeNumber=0;volumeNumber<volumes.size();volumeNumber++){
+      const typename ImageType::PixelType *pixel = volumes[volumeNumber]->GetBufferPointer();
+      const size_t numberOfPixels = volumes[volumeNumber]->GetBufferedRegion().GetNumberOfPixels();
+      if(!volumeNumber && numberOfPixels)
+        minValue = maxValue = pixel[0];
+      for(size_t pixelPosition=0;pixelPosition<numberOfPixels;pixelPosition++){
+        const double value = pixel[pixelPosition];
+        minValue = min(minValue, value);
+        maxValue = max(maxValue, value);
+        if(isIntegral && value != floor(value))
+          isIntegral = false;
+      }
+    }
+
+    if(isIntegral && minValue >= minStored && maxValue <= maxStored){
+      slope = 1;
+      intercept = 0;
+    } else {
+      slope = maxValue > minValue ? (maxValue-minValue)/(maxStored-minStored) : 1;
+      intercept = minValue-slope*minStored;
+      cout << "Input values in [" << minValue << "," << maxValue << "] are scaled to the stored pixel type with slope " <<
+           slope << " and intercept " << intercept << endl;
+    }
+  }
+
+  // FirstValueMapped and LastValueMapped are in stored pixel values, and are encoded as unsigned for unsigned
+  //  pixel data; the range of floating point values is rounded outwards to integers
+  template <class StoredPixelType>
+  static void setMappedValueRange(FGRealWorldValueMapping::RWVMItem &item, StoredPixelType minValue, StoredPixelType maxValue) {
+    item.setRealWorldValueFirstValueMappedSigned(
+        Sint16(max(floor(double(minValue)), double(numeric_limits<Sint16>::min()))));
+    item.setRealWorldValueLastValueMappedSigned(
+        Sint16(min(ceil(double(maxValue)), double(numeric_limits<Sint16>::max()))));
+  }
+
+  static void setMappedValueRange(FGRealWorldValueMapping::RWVMItem &item, Uint16 minValue, Uint16 maxValue) {
+    item.setRealWorldValueFirstValueMappedUnsigned(minValue);
+    item.setRealWorldValueLastValueMappedUnsigned(maxValue);
+  }
+
+  // the RWVM of the stored values is the mapping of the stored values to the input values (storedSlope and
+  //  storedIntercept), followed by the one given in the metadata; it is the same for all stored pixel types
+  template <class StoredPixelType>
+  static void setRealWorldValueMapping(FGRealWorldValueMapping::RWVMItem &item, const JSONParametricMapMetaInformationHandler &metaInfo,
+                                       double storedSlope, double storedIntercept,
+                                       StoredPixelType minValue, StoredPixelType maxValue) {
+    const double slope = metaInfo.getRealWorldValueSlope();
+    const double intercept = atof(metaInfo.getRealWorldValueIntercept().c_str());
+    item.setRealWorldValueSlope(slope*storedSlope);
+    item.setRealWorldValueIntercept(slope*storedIntercept+intercept);
+    setMappedValueRange(item, minValue, maxValue);
+  }
+
+  template <class ImageType, class ImagePixelModule>
+  DcmDataset* ParaMapConverter::createParametricMap(const vector<typename ImageType::Pointer> &volumes,
+                                                    vector<DcmDataset*> dcmDatasets, const string &metaData) {
+    typedef typename ImagePixelModule::value_type StoredPixelType;
+
+    // all volumes share the geometry of the first one
+    const typename ImageType::Pointer &parametricMapImage = volumes[0];
 
-    MinMaxCalculatorType::Pointer calculator = MinMaxCalculatorType::New();
-    calculator->SetImage(parametricMapImage);
-    calculator->Compute();
 
     JSONParametricMapMetaInformationHandler metaInfo(metaData);
     metaInfo.read();
 
-    metaInfo.setFirstValueMapped(calculator->GetMinimum());
-    metaInfo.setLastValueMapped(calculator->GetMaximum());
-
     IODEnhGeneralEquipmentModule::EquipmentInfo eq = getEnhEquipmentInfo();
     ContentIdentificationMacro contentID = createContentIdentificationInformation(metaInfo);
     CHECK_COND(contentID.setInstanceNumber(metaInfo.getInstanceNumber().c_str()));
@@ -38,11 +130,11 @@ namespace dcmqi {
     // TODO: initialize modality from the source / add to schema?
     OFString modality = "MR";
 
-    FloatImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
+    typename ImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
     cout << "Input image size: " << inputSize << endl;
 
     OFvariant<OFCondition,DPMParametricMapIOD> obj =
-        DPMParametricMapIOD::create<IODFloatingPointImagePixelModule>(modality, metaInfo.getSeriesNumber().c_str(),
+        DPMParametricMapIOD::create<ImagePixelModule>(modality, metaInfo.getSeriesNumber().c_str(),
                                                                       metaInfo.getInstanceNumber().c_str(),
                                                                       inputSize[1], inputSize[0], eq, contentID,
                                                                       imageFlavor, pixContrast, DPMTypes::CQ_RESEARCH);
@@ -66,12 +158,16 @@ namespace dcmqi {
     IODMultiframeDimensionModule &mfdim = pMapDoc->getIODMultiframeDimensionModule();
     OFCondition result = mfdim.addDimensionIndex(DCM_ImagePositionPatient, dimUID,
                                                  DCM_RealWorldValueMappingSequence, "Frame position");
+    // the volumes of a time series (or of any other parameter) are told apart by the temporal position
+    if(result.good() && volumes.size() > 1)
+      result = mfdim.addDimensionIndex(DCM_TemporalPositionIndex, dimUID,
+                                       DCM_FrameContentSequence, "Temporal position");
 
     // Shared FGs: PixelMeasuresSequence
     {
       FGPixelMeasures *pixmsr = new FGPixelMeasures();
 
-      FloatImageType::SpacingType labelSpacing = parametricMapImage->GetSpacing();
+      typename ImageType::SpacingType labelSpacing = parametricMapImage->GetSpacing();
       ostringstream spacingSStream;
       spacingSStream << scientific << labelSpacing[0] << "\\" << labelSpacing[1];
       CHECK_COND(pixmsr->setPixelSpacing(spacingSStream.str().c_str()));
@@ -87,7 +183,7 @@ namespace dcmqi {
     {
       OFString imageOrientationPatientStr;
 
-      FloatImageType::DirectionType labelDirMatrix = parametricMapImage->GetDirection();
+      typename ImageType::DirectionType labelDirMatrix = parametricMapImage->GetDirection();
 
       cout << "Directions: " << labelDirMatrix << endl;
 
@@ -132,12 +228,6 @@ namespace dcmqi {
       return NULL;
     }
 
-    realWorldValueMappingItem->setRealWorldValueSlope(metaInfo.getRealWorldValueSlope());
-    realWorldValueMappingItem->setRealWorldValueIntercept(atof(metaInfo.getRealWorldValueIntercept().c_str()));
-
-    realWorldValueMappingItem->setRealWorldValueFirstValueMappedSigned(metaInfo.getFirstValueMapped());
-    realWorldValueMappingItem->setRealWorldValueLastValueMappedSigned(metaInfo.getLastValueMapped());
-
     CodeSequenceMacro* measurementUnitCode = metaInfo.getMeasurementUnitsCode();
     if (measurementUnitCode != NULL) {
       realWorldValueMappingItem->getMeasurementUnitsCode().set(metaInfo.getCodeSequenceValue(measurementUnitCode).c_str(),
@@ -225,20 +315,16 @@ namespace dcmqi {
       }
     }
 
+    // the slope, intercept and range of the mapped values are only known once the frames are added, the FG is
+    //  added after them
     rwvmFG.getRealWorldValueMapping().push_back(realWorldValueMappingItem);
-    CHECK_COND(pMapDoc->addForAllFrames(rwvmFG));
 
     /* Map referenced instances to the ITK parametric map slices */
     // this is a hack - the function below needs to be factored out
     vector<vector<int> > slice2derimg;
     bool hasDerivationImages = false;
     {
-
-      typedef itk::CastImageFilter<FloatImageType,ShortImageType> CastFilterType;
-      CastFilterType::Pointer cast = CastFilterType::New();
-      cast->SetInput(parametricMapImage);
-      cast->Update();
-      slice2derimg = getSliceMapForSegmentation2DerivationImage(dcmDatasets, cast->GetOutput());
+      slice2derimg = getSliceMapForSegmentation2DerivationImage<ImageType>(dcmDatasets, parametricMapImage);
       cout << "Mapping from the ITK image slices to the DICOM instances in the input list" << endl;
       for(int i=0;i<slice2derimg.size();i++){
         cout << "  Slice " << i << ": ";
@@ -273,6 +359,14 @@ namespace dcmqi {
     if(hasDerivationImages)
       perFrameFGs.push_back(fgder);
 
+    const size_t frameSize = size_t(inputSize[0]) * inputSize[1];
+    StoredPixelType minValue = 0, maxValue = 0;
+    // frame buffer reused for all slices, when the pixels need to be converted to the stored pixel type
+    vector<StoredPixelType> storedPixels;
+    double storedSlope = 1, storedIntercept = 0;
+    if(numeric_limits<StoredPixelType>::is_integer)
+      getStoredValueMapping<ImageType,StoredPixelType>(volumes, storedSlope, storedIntercept);
+
     for (unsigned long sliceNumber = 0; result.good() && (sliceNumber < inputSize[2]); sliceNumber++) {
 
       OFVector<DcmDataset*> siVector;
@@ -334,38 +428,27 @@ namespace dcmqi {
       }
 
 
-      //result = addFrame(*pMapDoc, parametricMapImage, metaInfo, sliceNumber, perFrameFGs);
-
-      // addFrame
-      {
-        FloatImageType::RegionType sliceRegion;
-        FloatImageType::IndexType sliceIndex;
-        FloatImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
-
+      // addFrame, once for each of the volumes at this slice position
+      for(size_t volumeNumber=0;volumeNumber<volumes.size();volumeNumber++){
+        typename ImageType::IndexType sliceIndex;
         sliceIndex[0] = 0;
         sliceIndex[1] = 0;
         sliceIndex[2] = sliceNumber;
 
-        inputSize[2] = 1;
-
-        sliceRegion.SetIndex(sliceIndex);
-        sliceRegion.SetSize(inputSize);
-
-        const unsigned frameSize = inputSize[0] * inputSize[1];
-
-        OFVector<IODFloatingPointImagePixelModule::value_type> data(frameSize);
-
-        itk::ImageRegionConstIteratorWithIndex<FloatImageType> sliceIterator(parametricMapImage, sliceRegion);
-
-        unsigned framePixelCnt = 0;
-        for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd(); ++sliceIterator, ++framePixelCnt){
-          data[framePixelCnt] = sliceIterator.Get();
-          FloatImageType::IndexType idx = sliceIterator.GetIndex();
-          //      cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
+        // the slice is contiguous in the image buffer, and is copied by addFrame; the range of the values is
+        //  computed in the same pass, instead of a separate pass over the whole image
+        StoredPixelType *sliceData = StoredPixels<typename ImageType::PixelType,StoredPixelType>::get(
+            volumes[volumeNumber]->GetBufferPointer() + sliceNumber*frameSize, frameSize, storedPixels,
+            storedSlope, storedIntercept);
+        if(!sliceNumber && !volumeNumber)
+          minValue = maxValue = sliceData[0];
+        for(size_t pixelPosition=0;pixelPosition<frameSize;pixelPosition++){
+          minValue = min(minValue, sliceData[pixelPosition]);
+          maxValue = max(maxValue, sliceData[pixelPosition]);
         }
 
         // Plane Position
-        FloatImageType::PointType sliceOriginPoint;
+        typename ImageType::PointType sliceOriginPoint;
         parametricMapImage->TransformIndexToPhysicalPoint(sliceIndex, sliceOriginPoint);
         fgppp->setImagePositionPatient(
             Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
@@ -373,7 +456,12 @@ namespace dcmqi {
             Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
 
         // Frame Content
-        OFCondition result = fgfc->setDimensionIndexValues(sliceNumber+1 /* value within dimension */, 0 /* first dimension */);
+        result = fgfc->setDimensionIndexValues(sliceNumber+1 /* value within dimension */, 0 /* first dimension */);
+        if(result.good() && volumes.size() > 1){
+          result = fgfc->setDimensionIndexValues(volumeNumber+1, 1 /* second dimension */);
+          if(result.good())
+            result = fgfc->setTemporalPositionIndex(volumeNumber+1);
+        }
 
 #if ADD_DERIMG
         // Already pushed above if siVector.size > 0
@@ -381,10 +469,17 @@ namespace dcmqi {
           // perFrameFGs.push_back(fgder);
 #endif
 
-        DPMParametricMapIOD::FramesType frames = pMapDoc->getFrames();
-        result = OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&frames)->addFrame(&*data.begin(), frameSize, perFrameFGs);
+        if(result.good()){
+          DPMParametricMapIOD::FramesType frames = pMapDoc->getFrames();
+          result = OFget<DPMParametricMapIOD::Frames<StoredPixelType> >(&frames)->addFrame(sliceData, frameSize, perFrameFGs);
+        }
+        if(result.bad())
+          break;
 
-        cout << "Frame " << sliceNumber << " added" << endl;
+        cout << "Frame " << sliceNumber;
+        if(volumes.size() > 1)
+          cout << " of volume " << volumeNumber;
+        cout << " added" << endl;
       }
 
       // remove derivation image FG from the per-frame FGs, only if applicable!
@@ -394,14 +489,23 @@ namespace dcmqi {
       }
     }
 
-    // add ReferencedSeriesItem only if it is not empty
-    if(refinstances.size())
-      refseries.push_back(refseriesItem);
-
     delete fgppp;
     delete fgfc;
     delete fgder;
 
+    if(result.bad()){
+      cerr << "ERROR: Failed to add the parametric map frames: " << result.text() << endl;
+      delete refseriesItem;
+      return NULL;
+    }
+
+    setRealWorldValueMapping(*realWorldValueMappingItem, metaInfo, storedSlope, storedIntercept, minValue, maxValue);
+    CHECK_COND(pMapDoc->addForAllFrames(rwvmFG));
+
+    // add ReferencedSeriesItem only if it is not empty
+    if(refinstances.size())
+      refseries.push_back(refseriesItem);
+
     string bodyPartAssigned = metaInfo.getBodyPartExamined();
     if(srcDataset != NULL && bodyPartAssigned.empty()) {
       OFString bodyPartStr;
@@ -434,15 +538,130 @@ namespace dcmqi {
     return output;
   }
 
-  pair <FloatImageType::Pointer, string> ParaMapConverter::paramap2itkimage(DcmDataset *pmapDataset) {
+  DcmDataset* ParaMapConverter::itkimage2paramap(const FloatImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
+                                                 const string &metaData, const string &pixelType) {
+    return createFloatParametricMap(vector<FloatImageType::Pointer>(1, parametricMapImage), dcmDatasets, metaData, pixelType);
+  }
+
+  DcmDataset* ParaMapConverter::itkimage2paramap(const Float4DImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
+                                                 const string &metaData, const string &pixelType) {
+    // the volumes refer to the consecutive parts of the buffer of the 4D image, without copying them
+    const size_t numberOfVolumes = parametricMapImage->GetBufferedRegion().GetSize()[3];
+    cout << "Input image has " << numberOfVolumes << " volumes" << endl;
+
+    vector<FloatImageType::Pointer> volumes;
+    for(size_t volumeNumber=0;volumeNumber<numberOfVolumes;volumeNumber++)
+      volumes.push_back(getVolume(parametricMapImage, volumeNumber));
+
+    return createFloatParametricMap(volumes, dcmDatasets, metaData, pixelType);
+  }
+
+  DcmDataset* ParaMapConverter::createFloatParametricMap(const vector<FloatImageType::Pointer> &volumes,
+                                                         vector<DcmDataset*> dcmDatasets,
+                                                         const string &metaData, const string &pixelType) {
+    if(pixelType == "float")
+      return createParametricMap<FloatImageType,IODFloatingPointImagePixelModule>(volumes, dcmDatasets, metaData);
+    if(pixelType == "uint16")
+      return createParametricMap<FloatImageType,IODImagePixelModule<Uint16> >(volumes, dcmDatasets, metaData);
+    if(pixelType == "int16")
+      return createParametricMap<FloatImageType,IODImagePixelModule<Sint16> >(volumes, dcmDatasets, metaData);
+    cerr << "ERROR: unsupported parametric map pixel type " << pixelType << endl;
+    return NULL;
+  }
+
+  DcmDataset* ParaMapConverter::itkimage2paramap(const DoubleImageType::Pointer &parametricMapImage, vector<DcmDataset*> dcmDatasets,
+                                                 const string &metaData) {
+    return createParametricMap<DoubleImageType,IODDoubleFloatingPointImagePixelModule>(
+        vector<DoubleImageType::Pointer>(1, parametricMapImage), dcmDatasets, metaData);
+  }
+
+  template <class StoredPixelType>
+  bool ParaMapConverter::getFramePixels(DPMParametricMapIOD::FramesType &frames, const vector<size_t> &frameSlices,
+                                        FrameCopyJob &job) {
+    DPMParametricMapIOD::Frames<StoredPixelType> *typedFrames = OFget<DPMParametricMapIOD::Frames<StoredPixelType> >(&frames);
+    if(!typedFrames)
+      return false;
+
+    // each frame covers the whole slice, so the last frame at a position is the one that is kept
+    for(size_t frameId=0;frameId<frameSlices.size();frameId++)
+      job.items[frameSlices[frameId]].frame = typedFrames->getFrame(frameId);
+    job.copyPixels = &copyFramePixels<StoredPixelType>;
+    return true;
+  }
+
+  template <class StoredPixelType>
+  void ParaMapConverter::copyFramePixels(const void *frame, size_t numberOfPixels, double slope, double intercept,
+                                         FloatPixelType *slicePixels) {
+    const StoredPixelType *framePixels = static_cast<const StoredPixelType*>(frame);
+    for(size_t pixelPosition=0;pixelPosition<numberOfPixels;pixelPosition++)
+      slicePixels[pixelPosition] = FloatPixelType(slope*framePixels[pixelPosition]+intercept);
+  }
+
+  template <>
+  void ParaMapConverter::copyFramePixels<FloatPixelType>(const void *frame, size_t numberOfPixels, double, double,
+                                                         FloatPixelType *slicePixels) {
+    memcpy(slicePixels, frame, numberOfPixels*sizeof(FloatPixelType));
+  }
+
+  pair <FloatImageType::Pointer, string> ParaMapConverter::paramap2itkimage(DcmDataset *pmapDataset, unsigned numberOfThreads) {
+    pair <Float4DImageType::Pointer, string> result = paramap2itkimage4D(pmapDataset, numberOfThreads);
+    const Float4DImageType::Pointer &pmImage4D = result.first;
+
+    if(pmImage4D->GetLargestPossibleRegion().GetSize()[3] > 1){
+      cerr << "ERROR: The parametric map has " << pmImage4D->GetLargestPossibleRegion().GetSize()[3] <<
+        " volumes, and can only be read as a 4D image!" << endl;
+      throw -1;
+    }
+
+    return pair <FloatImageType::Pointer, string>(getFirstVolume(pmImage4D), result.second);
+  }
+
+  FloatImageType::Pointer ParaMapConverter::getFirstVolume(const Float4DImageType::Pointer &pmImage4D) {
+    return getVolume(pmImage4D, 0);
+  }
+
+  FloatImageType::Pointer ParaMapConverter::getVolume(const Float4DImageType::Pointer &image4D, size_t volumeNumber) {
+    const Float4DImageType::SizeType &size4D = image4D->GetLargestPossibleRegion().GetSize();
+    FloatImageType::SizeType volumeSize;
+    FloatImageType::PointType volumeOrigin;
+    FloatImageType::SpacingType volumeSpacing;
+    FloatImageType::DirectionType volumeDirection;
+    for(unsigned i=0;i<3;i++){
+      volumeSize[i] = size4D[i];
+      volumeOrigin[i] = image4D->GetOrigin()[i];
+      volumeSpacing[i] = image4D->GetSpacing()[i];
+      for(unsigned j=0;j<3;j++)
+        volumeDirection[i][j] = image4D->GetDirection()[i][j];
+    }
+
+    FloatImageType::Pointer volume = FloatImageType::New();
+    volume->SetRegions(volumeSize);
+    volume->SetOrigin(volumeOrigin);
+    volume->SetSpacing(volumeSpacing);
+    volume->SetDirection(volumeDirection);
+    if(!volumeNumber){
+      // the first volume covers the beginning of the buffer, and keeps the 4D image pixels alive
+      volume->SetPixelContainer(image4D->GetPixelContainer());
+    } else {
+      const size_t numberOfPixels = size_t(volumeSize[0])*volumeSize[1]*volumeSize[2];
+      FloatImageType::PixelContainer::Pointer volumeContainer = FloatImageType::PixelContainer::New();
+      volumeContainer->SetImportPointer(image4D->GetBufferPointer() + volumeNumber*numberOfPixels, numberOfPixels, false);
+      volume->SetPixelContainer(volumeContainer);
+    }
+    return volume;
+  }
+
+  pair <Float4DImageType::Pointer, string> ParaMapConverter::paramap2itkimage4D(DcmDataset *pmapDataset, unsigned numberOfThreads) {
 
     DcmRLEDecoderRegistration::registerCodecs();
 
     OFLogger dcemfinfLogger = OFLog::getLogger("qiicr.apps");
     dcemfinfLogger.setLogLevel(dcmtk::log4cplus::OFF_LOG_LEVEL);
 
+    // the parametric map is parsed only once, and used for both the frames and the meta information
     OFvariant<OFCondition,DPMParametricMapIOD*> result = DPMParametricMapIOD::loadDataset(*pmapDataset);
     if (OFCondition* pCondition = OFget<OFCondition>(&result)) {
+      cerr << "Failed to load parametric map! " << pCondition->text() << endl;
       throw -1;
     }
 
@@ -458,13 +677,12 @@ namespace dcmqi {
 
     // Spacing and origin
     double computedSliceSpacing, computedVolumeExtent;
-    vnl_vector<double> sliceDirection(3);
-    sliceDirection[0] = direction[0][2];
-    sliceDirection[1] = direction[1][2];
-    sliceDirection[2] = direction[2][2];
+    FrameGeometryIndex geometryIndex;
+    if(buildGeometryIndex(fgInterface, direction, geometryIndex))
+      throw -1;
 
     FloatImageType::PointType imageOrigin;
-    if(computeVolumeExtent(fgInterface, sliceDirection, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
+    if(computeVolumeExtent(geometryIndex, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
       cerr << "Failed to compute origin and/or slice spacing!" << endl;
       throw -1;
     }
@@ -494,132 +712,101 @@ namespace dcmqi {
       if(pmapDataset->findAndGetOFString(DCM_Columns, str).good())
         imageSize[0] = atoi(str.c_str());
     }
-    imageSize[2] = fgInterface.getNumberOfFrames();
+    imageSize[2] = geometryIndex.getNumberOfPositions();
 
-    FloatImageType::RegionType imageRegion;
-    imageRegion.SetSize(imageSize);
-    FloatImageType::Pointer pmImage = FloatImageType::New();
-    pmImage->SetRegions(imageRegion);
-    pmImage->SetOrigin(imageOrigin);
-    pmImage->SetSpacing(imageSpacing);
-    pmImage->SetDirection(direction);
+    // volumes of the frames, by TemporalPositionIndex; maps without it have a single volume
+    vector<Uint32> frameTemporalPositions(fgInterface.getNumberOfFrames(), 0);
+    map<Uint32, size_t> temporalPosition2volume;
+    for(size_t frameId=0;frameId<fgInterface.getNumberOfFrames();frameId++){
+      bool isPerFrame;
+
+      FGFrameContent *fracon =
+          OFstatic_cast(FGFrameContent*,fgInterface.get(frameId, DcmFGTypes::EFG_FRAMECONTENT, isPerFrame));
+      assert(fracon);
+      if(fracon)
+        fracon->getTemporalPositionIndex(frameTemporalPositions[frameId]);
+      temporalPosition2volume[frameTemporalPositions[frameId]] = 0;
+    }
+    size_t numberOfVolumes = 0;
+    for(map<Uint32, size_t>::iterator tIt=temporalPosition2volume.begin();tIt!=temporalPosition2volume.end();++tIt)
+      tIt->second = numberOfVolumes++;
+
+    Float4DImageType::SizeType imageSize4D;
+    Float4DImageType::PointType imageOrigin4D;
+    Float4DImageType::SpacingType imageSpacing4D;
+    Float4DImageType::DirectionType direction4D;
+    direction4D.SetIdentity();
+    for(unsigned i=0;i<3;i++){
+      imageSize4D[i] = imageSize[i];
+      imageOrigin4D[i] = imageOrigin[i];
+      imageSpacing4D[i] = imageSpacing[i];
+      for(unsigned j=0;j<3;j++)
+        direction4D[i][j] = direction[i][j];
+    }
+    imageSize4D[3] = numberOfVolumes;
+    imageOrigin4D[3] = 0;
+    imageSpacing4D[3] = 1;
+
+    Float4DImageType::Pointer pmImage = Float4DImageType::New();
+    pmImage->SetRegions(imageSize4D);
+    pmImage->SetOrigin(imageOrigin4D);
+    pmImage->SetSpacing(imageSpacing4D);
+    pmImage->SetDirection(direction4D);
+    // not zero-filled; every slice is either copied from a frame or cleared by copyFrameWorkItem
     pmImage->Allocate();
-    pmImage->FillBuffer(0);
 
     JSONParametricMapMetaInformationHandler metaInfo;
-    populateMetaInformationFromDICOM(pmapDataset, metaInfo);
+    populateMetaInformationFromDICOM(pmapDataset, pMapDoc, metaInfo);
 
     DPMParametricMapIOD::FramesType obj = pMapDoc->getFrames();
     if (OFCondition* pCondition = OFget<OFCondition>(&obj)) {
       throw -1;
     }
 
-    DPMParametricMapIOD::Frames<FloatPixelType> frames = *OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&obj);
-
-    for(int frameId=0;frameId<fgInterface.getNumberOfFrames();frameId++){
-
-      FloatPixelType *frame = frames.getFrame(frameId);
-
-      bool isPerFrame;
-
-      FGPlanePosPatient *planposfg =
-          OFstatic_cast(FGPlanePosPatient*,fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-      assert(planposfg);
-
-      FGFrameContent *fracon =
-          OFstatic_cast(FGFrameContent*,fgInterface.get(frameId, DcmFGTypes::EFG_FRAMECONTENT, isPerFrame));
-      assert(fracon);
-
-      // populate meta information needed for Slicer ScalarVolumeNode initialization
-      {
-      }
-
-      FloatImageType::IndexType index;
-      // initialize slice with the frame content
-      for(int row=0;row<imageSize[1];row++){
-        index[1] = row;
-        index[2] = frameId;
-        for(int col=0;col<imageSize[0];col++){
-          unsigned pixelPosition = row*imageSize[0] + col;
-          index[0] = col;
-          pmImage->SetPixel(index, frame[pixelPosition]);
-        }
-      }
+    // group the frames by the slice of the volume they are copied to
+    FrameCopyJob job;
+    job.frameSize = size_t(imageSize[0])*imageSize[1];
+    job.items.resize(imageSize[2]*numberOfVolumes);
+    for(size_t sliceNumber=0;sliceNumber<job.items.size();sliceNumber++){
+      job.items[sliceNumber].slicePixels = pmImage->GetBufferPointer() + sliceNumber*job.frameSize;
+      job.items[sliceNumber].frame = NULL;
     }
 
-    return pair <FloatImageType::Pointer, string>(pmImage, metaInfo.getJSONOutputAsString());
-  }
-
-  OFCondition ParaMapConverter::addFrame(DPMParametricMapIOD &map, const FloatImageType::Pointer &parametricMapImage,
-                                         const JSONParametricMapMetaInformationHandler &metaInfo,
-                                         const unsigned long frameNo, OFVector<FGBase*> groups)
-  {
-    FloatImageType::RegionType sliceRegion;
-    FloatImageType::IndexType sliceIndex;
-    FloatImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
-
-    sliceIndex[0] = 0;
-    sliceIndex[1] = 0;
-    sliceIndex[2] = frameNo;
+    vector<size_t> frameSlices(fgInterface.getNumberOfFrames());
+    for(size_t frameId=0;frameId<frameSlices.size();frameId++)
+      frameSlices[frameId] = temporalPosition2volume[frameTemporalPositions[frameId]]*imageSize[2] +
+                             geometryIndex.getPositionNumber(frameId);
 
-    inputSize[2] = 1;
-
-    sliceRegion.SetIndex(sliceIndex);
-    sliceRegion.SetSize(inputSize);
-
-    const unsigned frameSize = inputSize[0] * inputSize[1];
-
-    OFVector<IODFloatingPointImagePixelModule::value_type> data(frameSize);
-
-    itk::ImageRegionConstIteratorWithIndex<FloatImageType> sliceIterator(parametricMapImage, sliceRegion);
-
-    unsigned framePixelCnt = 0;
-    for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd(); ++sliceIterator, ++framePixelCnt){
-      data[framePixelCnt] = sliceIterator.Get();
-      FloatImageType::IndexType idx = sliceIterator.GetIndex();
-//      cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
-    }
-
-    OFunique_ptr<FGPlanePosPatient> fgPlanePos(new FGPlanePosPatient);
-    OFunique_ptr<FGFrameContent > fgFracon(new FGFrameContent);
-    if (!fgPlanePos  || !fgFracon)
-    {
-      return EC_MemoryExhausted;
+    // floating point values are read as they are stored, and integer ones are mapped to the real world values,
+    //  which the metadata then describes with an identity mapping
+    job.slope = 1;
+    job.intercept = 0;
+    if(getFramePixels<Uint16>(obj, frameSlices, job) || getFramePixels<Sint16>(obj, frameSlices, job)){
+      FGRealWorldValueMapping* rw = OFstatic_cast(FGRealWorldValueMapping*,
+                                                  fgInterface.get(0, DcmFGTypes::EFG_REALWORLDVALUEMAPPING));
+      if(rw && rw->getRealWorldValueMapping().size() > 0){
+        FGRealWorldValueMapping::RWVMItem *item = rw->getRealWorldValueMapping()[0];
+        item->getData().findAndGetFloat64(DCM_RealWorldValueSlope, job.slope);
+        item->getData().findAndGetFloat64(DCM_RealWorldValueIntercept, job.intercept);
+      }
+      metaInfo.setRealWorldValueSlope(1);
+      metaInfo.setRealWorldValueIntercept("0");
+    } else if(!getFramePixels<Float32>(obj, frameSlices, job) && !getFramePixels<Float64>(obj, frameSlices, job)){
+      cerr << "ERROR: unsupported parametric map pixel type" << endl;
+      throw -1;
     }
 
-    // Plane Position
-    FloatImageType::PointType sliceOriginPoint;
-    parametricMapImage->TransformIndexToPhysicalPoint(sliceIndex, sliceOriginPoint);
-    fgPlanePos->setImagePositionPatient(
-        Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
-        Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
-        Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
+    Helper::parallelFor(job.items.size(), numberOfThreads, &copyFrameWorkItem, &job);
 
-    // Frame Content
-    OFCondition result = fgFracon->setDimensionIndexValues(frameNo+1 /* value within dimension */, 0 /* first dimension */);
+    // the frames are owned by the parametric map
+    delete pMapDoc;
 
-    // Add frame with related groups
-    if (result.good())
-    {
-      groups.push_back(fgPlanePos.get());
-      groups.push_back(fgFracon.get());
-      groups.push_back(fgPlanePos.get());
-      DPMParametricMapIOD::FramesType frames = map.getFrames();
-      result = OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&frames)->addFrame(&*data.begin(), frameSize, groups);
-    }
-    return result;
+    return pair <Float4DImageType::Pointer, string>(pmImage, metaInfo.getJSONOutputAsString());
   }
 
-  void ParaMapConverter::populateMetaInformationFromDICOM(DcmDataset *pmapDataset,
+  void ParaMapConverter::populateMetaInformationFromDICOM(DcmDataset *pmapDataset, DPMParametricMapIOD *pMapDoc,
                                                           JSONParametricMapMetaInformationHandler &metaInfo) {
 
-    OFvariant<OFCondition,DPMParametricMapIOD*> result = DPMParametricMapIOD::loadDataset(*pmapDataset);
-    if (OFCondition* pCondition = OFget<OFCondition>(&result)) {
-      cerr << "Failed to load parametric map! " << pCondition->text() << endl;
-      throw -1;
-    }
-    DPMParametricMapIOD* pMapDoc = *OFget<DPMParametricMapIOD*>(&result);
-
     OFString temp;
 
     pMapDoc->getSeries().getSeriesDescription(temp);
@@ -706,7 +893,16 @@ namespace dcmqi {
       fa->getLaterality(frameLaterality);
       metaInfo.setFrameLaterality(fa->laterality2Str(frameLaterality).c_str());
     }
-    if(pMapDoc != NULL)
-      delete pMapDoc;
   }
+
+  void ParaMapConverter::copyFrameWorkItem(size_t sliceNumber, void *job) {
+    FrameCopyJob *copyJob = static_cast<FrameCopyJob*>(job);
+    const FrameCopyItem &item = copyJob->items[sliceNumber];
+    // frames are stored row by row, in the same order as the slice in the image buffer
+    if(item.frame)
+      copyJob->copyPixels(item.frame, copyJob->frameSize, copyJob->slope, copyJob->intercept, item.slicePixels);
+    else
+      fill(item.slicePixels, item.slicePixels+copyJob->frameSize, FloatPixelType(0));
+  }
+
 }
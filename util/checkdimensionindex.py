@@ -0,0 +1,18 @@
+import struct, sys
+
+# Check that a DICOM file written in little endian transfer syntax has a DimensionIndexPointer
+#  (0020,9165) referring to the given attribute, e.g. 0020,9128 for TemporalPositionIndex
+
+if len(sys.argv) < 3:
+  sys.exit('Usage: checkdimensionindex.py <DICOM file> <group,element>')
+
+group, element = [int(x, 16) for x in sys.argv[2].split(',')]
+value = struct.pack('<HH', group, element)
+
+explicitVR = struct.pack('<HH', 0x0020, 0x9165) + b'AT' + struct.pack('<H', 4) + value
+implicitVR = struct.pack('<HHI', 0x0020, 0x9165, 4) + value
+
+data = open(sys.argv[1], 'rb').read()
+if explicitVR not in data and implicitVR not in data:
+  print('No DimensionIndexPointer refers to (%04X,%04X)' % (group, element))
+  sys.exit(1)
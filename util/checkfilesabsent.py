@@ -0,0 +1,11 @@
+import os, sys
+
+# Check that none of the given files exist, e.g. the outputs that a converter is expected to skip
+
+if len(sys.argv) < 2:
+  sys.exit('Usage: checkfilesabsent.py <file> [<file> ...]')
+
+existing = [f for f in sys.argv[1:] if os.path.exists(f)]
+if existing:
+  print('Unexpected files: ' + ', '.join(existing))
+  sys.exit(1)
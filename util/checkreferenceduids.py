@@ -0,0 +1,28 @@
+import re, sys
+
+# Check that a DICOM file contains each of the expected UIDs, and none of the unexpected ones; the UIDs
+#  are given as comma-separated lists
+
+if len(sys.argv) < 3:
+  sys.exit('Usage: checkreferenceduids.py <DICOM file> <expected UIDs> [<unexpected UIDs>]')
+
+data = open(sys.argv[1], 'rb').read()
+
+def containsUID(uid):
+  # the UID must not be the prefix of a longer one
+  return re.search(re.escape(uid.encode('ascii')) + b'(?![0-9.])', data) is not None
+
+failed = False
+for uid in sys.argv[2].split(','):
+  if not containsUID(uid):
+    print('Missing UID ' + uid)
+    failed = True
+
+if len(sys.argv) > 3:
+  for uid in sys.argv[3].split(','):
+    if containsUID(uid):
+      print('Unexpected UID ' + uid)
+      failed = True
+
+if failed:
+  sys.exit(1)